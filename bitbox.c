@@ -98,7 +98,6 @@ bitbox_main(void)
         // to kill the whole program context (variables, etc). Maybe reset just
         // the tokenizer.
         ubasic_init(buf);
-        line_num = 0;
         statements();
         putstrz("\nREADY\n");
     }
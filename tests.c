@@ -33,7 +33,9 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
 #include "ubasic.h"
+#include "tokenizer.h"
 
 static const char program_let[] =
 "10 let a = 42\n\
@@ -76,6 +78,107 @@ static const char program_peek_poke[] =
 40 poke 0, 0\n\
 50 stop\n";
 
+static const char program_vars[] =
+"10 let l = 7\n\
+20 let a0 = 5 : let z9 = 3\n\
+30 let m = a0 + z9\n\
+40 stop\n";
+
+static const char program_jit[] =
+"5 b = 0 : c = 0 : s = 0 : z = 0\n\
+10 for i = 1 to 40\n\
+20 a = i * i - 3 : if i mod 3 = 0 then a = 0 - a : s = s + 1\n\
+30 x = sgn(a) + abs(a) / 7 : y = x and 5 or i > 20 : z = z + peek(i)\n\
+40 next i\n\
+50 for i = 20 to 1 step -2 : for j = 1 to 5\n\
+60 b = b + (a + i * j) mod 11 : if j = i / 4 then c = c + j\n\
+70 next j : next i\n\
+80 stop\n";
+
+static const char program_slices[] =
+"10 a = 0 : for i = 1 to 1000 : a = a + 1 : next i\n\
+20 if a = 1000 then b = 0 : for j = 0 to 9 : b = b + a / 100 : next j\n\
+30 stop\n";
+
+static const char program_divzero[] =
+"10 a = 1 : b = a / 0\n";
+
+static const char program_arrays[] =
+"10 dim a(2, 3, 4) : dim b$(3) : dim c(5) : dim d(2, 3)\n\
+20 for i = 0 to 2 : for j = 0 to 3 : d(i, j) = i * 10 + j : for k = 0 to 4\n\
+30 a(i, j, k) = i * 100 + j * 10 + k : next k : next j : next i\n\
+40 c(5) = 7 : b$(3) = \"end\" : b$(0) = \"start\"\n\
+50 s = 0 : for i = 0 to 2 : s = s + a(i, 3, 4) : next i\n\
+60 x = a(1, 2, 3) : y = c(5) + c(0) : z = len(b$(3)) + len(b$(1)) : w = d(2, 0) + d(0, 3)\n";
+
+static const char program_subscript[] =
+"10 dim a(3) : a(3) = 1 : a(4) = 2\n";
+
+static const char program_nodim[] =
+"10 x = c(0)\n";
+
+static const char program_nodim_str[] =
+"10 x$ = c$(0)\n";
+
+static const char program_next[] =
+"10 a = 1\n\
+20 next a\n";
+
+static const char program_input[] =
+"10 input a : print a;\n\
+20 input \"name\"; b$, c\n\
+30 d = len(b$)\n";
+
+static const char program_temps[] =
+"10 a$ = \"0123456789\" : a$ = a$ + a$ + a$ + a$ : a$ = a$ + a$ + a$ + a$\n\
+20 b$ = mid$(a$ + \"x\", 2, 5) + mid$(a$ + \"y\", 3, 5) + right$(a$ + \"z\", 5)\n\
+30 l = len(b$) : c = code(b$) : z = code(right$(b$, 1))\n";
+
+static const char program_heap[] =
+"10 for i = 1 to 50\n\
+20 a$ = left$(\"abcdefghijklmnopqrstuvwxyz\", i mod 20) : b$ = a$ + b$\n\
+30 if len(b$) > 100 then b$ = mid$(b$, 3, 12)\n\
+40 next i\n\
+50 l = len(b$) : c = code(b$)\n";
+
+static const char program_append[] =
+"10 a$ = \"\" : for i = 1 to 200 : a$ = a$ + chr$(48 + i mod 10) : next i\n\
+20 b$ = \"ab\" : b$ = b$ + b$ + \"c\" : b$ = b$ + mid$(b$, 2, 3)\n\
+30 l = len(a$) : c = code(right$(a$, 1)) : m = len(b$) : d = code(right$(b$, 1))\n";
+
+static const char program_views[] =
+"10 r$ = \"2017-06-30 ok\" : y = 0 : m = 0 : e = 0\n\
+20 if mid$(r$, 6, 2) = \"06\" then m = val(mid$(r$, 6, 2))\n\
+30 if left$(r$, 2) < \"30\" then y = val(left$(r$, 4))\n\
+40 c = code(right$(r$, 2)) : l = len(mid$(r$, 9, 99)) : n = len(right$(r$, 20))\n\
+50 a$ = mid$(r$, 6, 5) : a$ = mid$(a$, 4, 2) : b$ = right$(r$, 2) + left$(r$, 1)\n\
+60 if \"a\" < \"c\" and \"ca\" > \"a\" then e = 1\n";
+
+/* VAL() of an empty part of a string, or of just a sign, is an error */
+static const char *program_views_bad[] = {
+"10 r$ = \"-12\" : v = val(left$(r$, 0))\n",
+"10 v = val(mid$(\"-5\", 1, 1))\n",
+NULL
+};
+
+static const char program_instr[] =
+"10 a$ = \"the quick brown fox jumps over the lazy dog\" : b$ = a$ + a$\n\
+20 a = instr(1, a$, \"the\") : b = instr(2, a$, \"the\") : c = instr(1, a$, \"cat\")\n\
+30 d = instr(1, a$, \"\") : e = instr(50, a$, \"g\") : f = instr(-3, a$, \"dog\")\n\
+40 g = instr(1, a$, \"g\") : h = instr(1, \"ab\", \"abc\") : i = instr(45, b$, \"dog\")\n\
+50 j = instr(1, b$, \"dogthe q\") : l = 0 : m = 0 : n = 0\n\
+60 if b$ + \"a\" < b$ + \"b\" then l = 1\n\
+70 if left$(b$, 85) < b$ and b$ > left$(b$, 85) then m = 1\n\
+80 if b$ = a$ + a$ and b$ <> a$ then n = 1\n";
+
+static const char program_long[] =
+"10 a$ = \"\" : for i = 1 to 10 : a$ = a$ + \"0123456789abcdefghijklmnopqrstuvwxyzABCD\" : next i\n\
+20 b$ = mid$(a$, 281, 12) : n = len(a$) : p = instr(1, a$ + \"!\", \"!\") : c$ = a$\n";
+
+static const char program_print[] =
+"10 print \"n=\"; 12, chr$(65)\n\
+20 print tab(3); -4\n";
+
 /*---------------------------------------------------------------------------*/
 value_t peek(value_t arg) {
     return arg;
@@ -111,6 +214,365 @@ void run(const char program[]) {
   printf("done. Run time: %.3f s\n", delta_t);
 }
 
+/*---------------------------------------------------------------------------*/
+/* Run once through the interpreter alone and once with hot loops compiled,
+   the listed variables must come out the same */
+void run_jit(const char program[], const char *vars) {
+  struct typevalue v;
+  value_t values[26];
+  int i;
+
+  ubasic_jit(0);
+  run(program);
+  for (i = 0; vars[i]; i++) {
+    ubasic_get_variable(vars[i] - 'a', &v, 0, NULL);
+    values[i] = v.d.i;
+  }
+  ubasic_jit(1);
+  run(program);
+  for (i = 0; vars[i]; i++) {
+    ubasic_get_variable(vars[i] - 'a', &v, 0, NULL);
+    assert(v.d.i == values[i]);
+  }
+}
+/*---------------------------------------------------------------------------*/
+/* Two programs run a line at a time in turn, neither may see the other */
+void run_two(const char program1[], const char program2[]) {
+  struct ubasic *u1 = ubasic_new();
+  struct ubasic *u2 = ubasic_new();
+  struct typevalue v;
+
+  ubasic_use(u1);
+  ubasic_init_peek_poke(program1, &peek, &poke);
+  /* ubasic_run() stops after a line, with either engine */
+  assert(ubasic_run() == UBASIC_YIELD);
+  ubasic_get_variable(0, &v, 0, NULL);
+  assert(v.d.i == 1);
+  ubasic_get_variable(1, &v, 0, NULL);
+  assert(v.d.i == 0);
+  ubasic_use(u2);
+  ubasic_init_peek_poke(program2, &peek, &poke);
+  do {
+    ubasic_use(u1);
+    if (!ubasic_finished())
+      ubasic_run_budget(1);
+    ubasic_use(u2);
+    if (!ubasic_finished())
+      ubasic_run_budget(1);
+    ubasic_use(u1);
+  } while(!ubasic_finished());
+
+  ubasic_get_variable(1, &v, 0, NULL);
+  assert(v.d.i == 89 && v.type == TYPE_INTEGER);
+  ubasic_free(u1);
+  ubasic_use(u2);
+  ubasic_get_variable(0, &v, 0, NULL);
+  assert(v.d.i == 123 && v.type == TYPE_INTEGER);
+  ubasic_free(u2);
+}
+
+/*---------------------------------------------------------------------------*/
+/* A program run a few statements at a time gives the same result however
+   small the slices, even when a whole loop is on one line */
+void run_budget(const char program[], long n, int slices) {
+  struct typevalue v;
+  int i = 0;
+
+  ubasic_init_peek_poke(program, &peek, &poke);
+  while (ubasic_run_budget(n) == UBASIC_YIELD)
+    i++;
+  assert(i >= slices);
+  ubasic_get_variable(0, &v, 0, NULL);
+  assert(v.d.i == 1000);
+  ubasic_get_variable(1, &v, 0, NULL);
+  assert(v.d.i == 100);
+}
+
+void run_budget_error(const char program[]) {
+  ubasic_init_peek_poke(program, &peek, &poke);
+  assert(ubasic_run_budget(100) == UBASIC_ERROR);
+  assert(ubasic_finished());
+  assert(ubasic_run_budget(100) == UBASIC_ERROR);
+}
+
+/*---------------------------------------------------------------------------*/
+/* A statement can use more temporary string space than one chunk holds */
+void run_temps(const char program[]) {
+  struct ubasic_string_stats st;
+  struct typevalue v;
+
+  run(program);
+  ubasic_get_variable(11, &v, 0, NULL);
+  assert(v.d.i == 15);
+  ubasic_get_variable(2, &v, 0, NULL);
+  assert(v.d.i == '1');
+  ubasic_get_variable(25, &v, 0, NULL);
+  assert(v.d.i == 'z');
+  ubasic_string_stats(&st);
+  assert(st.temp_high > 512 && st.temp_chunks >= 2);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Strings rebuilt over and over reuse their blocks rather than pile up */
+void run_heap(const char program[]) {
+  struct ubasic *u = ubasic_new();
+  struct ubasic_string_stats st;
+  struct typevalue v;
+
+  ubasic_use(u);
+  run(program);
+  ubasic_get_variable(11, &v, 0, NULL);
+  assert(v.d.i == 61);
+  ubasic_get_variable(2, &v, 0, NULL);
+  assert(v.d.i == 'a');
+  ubasic_get_variable(1 | STRINGFLAG, &v, 0, NULL);
+  assert(v.type == TYPE_STRING && v.len == 61 && v.s[60] == 'h');
+  ubasic_string_stats(&st);
+  assert(st.heap_used <= 512 + 32 && st.heap_size <= 4 * 1024);
+  ubasic_free(u);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Adding to the end of a string, including parts of itself */
+void run_append(const char program[]) {
+  struct ubasic *u = ubasic_new();
+  struct typevalue v;
+
+  ubasic_use(u);
+  run(program);
+  ubasic_get_variable(11, &v, 0, NULL);
+  assert(v.d.i == 200);
+  ubasic_get_variable(2, &v, 0, NULL);
+  assert(v.d.i == '0');
+  ubasic_get_variable(1 | STRINGFLAG, &v, 0, NULL);
+  assert(v.len == 8 && memcmp(v.s, "ababcbab", 8) == 0);
+  ubasic_free(u);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Parts of strings taken with LEFT$, RIGHT$ and MID$ */
+void run_views(const char program[]) {
+  struct typevalue v;
+  int i;
+
+  run(program);
+  ubasic_get_variable(24, &v, 0, NULL);
+  assert(v.d.i == 2017);
+  ubasic_get_variable(12, &v, 0, NULL);
+  assert(v.d.i == 6);
+  ubasic_get_variable(2, &v, 0, NULL);
+  assert(v.d.i == 'o');
+  ubasic_get_variable(11, &v, 0, NULL);
+  assert(v.d.i == 5);
+  ubasic_get_variable(13, &v, 0, NULL);
+  assert(v.d.i == 0);
+  ubasic_get_variable(4, &v, 0, NULL);
+  assert(v.d.i == 1);
+  ubasic_get_variable(0 | STRINGFLAG, &v, 0, NULL);
+  assert(v.len == 2 && memcmp(v.s, "30", 2) == 0);
+  ubasic_get_variable(1 | STRINGFLAG, &v, 0, NULL);
+  assert(v.len == 3 && memcmp(v.s, "ok2", 3) == 0);
+  for (i = 0; program_views_bad[i]; i++)
+    run_budget_error(program_views_bad[i]);
+}
+
+/*---------------------------------------------------------------------------*/
+/* INSTR and comparing strings long enough to take the vector paths */
+void run_instr(const char program[]) {
+  static const value_t expect[] = { 1, 32, 0, 1, 0, 41, 43, 0, 84, 41 };
+  struct typevalue v;
+  int i;
+
+  run(program);
+  for (i = 0; i < 10; i++) {
+    ubasic_get_variable(i, &v, 0, NULL);
+    assert(v.d.i == expect[i]);
+  }
+  for (i = 11; i < 14; i++) {
+    ubasic_get_variable(i, &v, 0, NULL);
+    assert(v.d.i == 1);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* Strings over 255 bytes need the two byte length of UBASIC_LONG_STRINGS */
+void run_long(const char program[]) {
+  struct ubasic *u = ubasic_new();
+  struct typevalue v;
+
+  ubasic_use(u);
+  ubasic_init(program);
+#ifdef UBASIC_LONG_STRINGS
+  assert(ubasic_run_budget(100000) == UBASIC_DONE);
+  ubasic_get_variable(13, &v, 0, NULL);
+  assert(v.d.i == 400);
+  ubasic_get_variable(15, &v, 0, NULL);
+  assert(v.d.i == 401);
+  ubasic_get_variable(1 | STRINGFLAG, &v, 0, NULL);
+  assert(v.len == 12 && memcmp(v.s, "0123456789ab", 12) == 0);
+  ubasic_get_variable(2 | STRINGFLAG, &v, 0, NULL);
+  assert(v.len == 400 && v.s[399] == 'D');
+#else
+  assert(ubasic_run_budget(100000) == UBASIC_ERROR);
+  ubasic_get_variable(0 | STRINGFLAG, &v, 0, NULL);
+  assert(v.len == 240);
+#endif
+  ubasic_free(u);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Arrays of up to four dimensions, subscripts 0 to the size given to DIM.
+   Run twice as a new run starts without them */
+void run_arrays(const char program[]) {
+  struct ubasic *u = ubasic_new();
+  struct typevalue v;
+  int i;
+
+  ubasic_use(u);
+  for (i = 0; i < 2; i++) {
+    run(program);
+    ubasic_get_variable(18, &v, 0, NULL);
+    assert(v.d.i == 402);
+    ubasic_get_variable(23, &v, 0, NULL);
+    assert(v.d.i == 123);
+    ubasic_get_variable(24, &v, 0, NULL);
+    assert(v.d.i == 7);
+    ubasic_get_variable(25, &v, 0, NULL);
+    assert(v.d.i == 3);
+    ubasic_get_variable(22, &v, 0, NULL);
+    assert(v.d.i == 23);
+  }
+  ubasic_free(u);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Output can be sent somewhere other than the screen */
+static char out_buf[64];
+static unsigned int out_len;
+
+static void out_char(char c, void *ctx) {
+  assert(ctx == out_buf && out_len < sizeof(out_buf) - 1);
+  out_buf[out_len++] = c;
+}
+
+void run_output(const char program[], const char *expect) {
+  struct ubasic *u = ubasic_new();
+
+  ubasic_use(u);
+  ubasic_output(out_char, out_buf);
+  run(program);
+  out_buf[out_len] = 0;
+  assert(strcmp(out_buf, expect) == 0);
+  ubasic_free(u);
+}
+
+/*---------------------------------------------------------------------------*/
+/* INPUT stops the program until each line is given, prompting once */
+void run_input(const char program[]) {
+  struct ubasic *u = ubasic_new();
+  struct typevalue v;
+
+  ubasic_use(u);
+  out_len = 0;
+  ubasic_output(out_char, out_buf);
+  ubasic_input_async(1);
+  ubasic_init_peek_poke(program, &peek, &poke);
+  assert(ubasic_run_budget(100) == UBASIC_INPUT);
+  assert(ubasic_run_budget(100) == UBASIC_INPUT);
+  ubasic_input("12\n", 3);
+  assert(ubasic_run_budget(100) == UBASIC_INPUT);
+  ubasic_input("bitbox\n", 7);
+  assert(ubasic_run_budget(100) == UBASIC_INPUT);
+  ubasic_input("-3", 2);
+  assert(ubasic_run_budget(100) == UBASIC_DONE);
+  out_buf[out_len] = 0;
+  assert(strcmp(out_buf, "? 12name") == 0);
+  ubasic_get_variable(2, &v, 0, NULL);
+  assert(v.d.i == -3);
+  ubasic_get_variable(3, &v, 0, NULL);
+  assert(v.d.i == 6);
+
+  /* No more input is an error */
+  ubasic_init_peek_poke(program, &peek, &poke);
+  assert(ubasic_run_budget(100) == UBASIC_INPUT);
+  ubasic_input(NULL, 0);
+  assert(ubasic_run_budget(100) == UBASIC_ERROR);
+  ubasic_free(u);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Raw tokenizer speed on a large made up program */
+static char bench_program[96 * 1024];
+
+static void bench_line(line_t line, char const *pos)
+{
+}
+
+void tokenize_bench(void) {
+  struct ubasic *u = ubasic_new();
+  clock_t start_t;
+  double delta_t;
+  int len = 0;
+  int line = 10;
+  int i;
+
+  while(len < (int)sizeof(bench_program) - 256) {
+    len += snprintf(bench_program + len, sizeof(bench_program) - len,
+      "%d for i = 1 to 100 step 2 : let a(i) = a(i) + b * peek(i) - c0 mod 7\n"
+      "%d if a >= b and c <> d then print \"hello\"; x$, left$(y$, 3)\n"
+      "%d next i : gosub 1000 : rem the rest of the line is dropped\n",
+      line, line + 10, line + 20);
+    line += 30;
+  }
+
+  printf("Tokenizing %d bytes... ", len);
+  fflush(stdout);
+  /* On an instance of its own so the one the tests use keeps its program */
+  ubasic_use(u);
+  start_t = clock();
+  for (i = 0; i < 200; i++)
+    tokenizer_init(bench_program, bench_line);
+  delta_t = (double)(clock() - start_t) / CLOCKS_PER_SEC;
+  ubasic_free(u);
+  printf("%.1f MB/s\n", len * 200.0 / delta_t / 1e6);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Searching a record for a word that is near its end, as INSTR against the
+   MID$ loop that had to be written without it */
+static const char program_instr_bench[] =
+"10 r$ = \"\" : for i = 1 to 24 : r$ = r$ + \"field\" + chr$(48 + i mod 10) + \",\" : next i\n\
+20 r$ = r$ + \"target,\" : n = 0\n\
+30 for i = 1 to 2000 : n = n + instr(1, r$, \"target\") : next i\n";
+
+static const char program_mid_bench[] =
+"10 r$ = \"\" : for i = 1 to 24 : r$ = r$ + \"field\" + chr$(48 + i mod 10) + \",\" : next i\n\
+20 r$ = r$ + \"target,\" : n = 0\n\
+30 for i = 1 to 20 : for j = 1 to len(r$) - 5\n\
+40 if mid$(r$, j, 6) = \"target\" then n = n + j : j = len(r$)\n\
+50 next j : next i\n";
+
+static double bench_run(const char program[]) {
+  struct ubasic *u = ubasic_new();
+  clock_t start_t = clock();
+  double delta_t;
+
+  ubasic_use(u);
+  ubasic_init(program);
+  while(ubasic_run() == UBASIC_YIELD);
+  delta_t = (double)(clock() - start_t) / CLOCKS_PER_SEC;
+  ubasic_free(u);
+  return delta_t;
+}
+
+void instr_bench(void) {
+  double instr_t, mid_t;
+
+  instr_t = bench_run(program_instr_bench);
+  mid_t = bench_run(program_mid_bench);
+  printf("INSTR %.2f us per search, MID$ loop %.2f us\n",
+    instr_t * 1e6 / 2000, mid_t * 1e6 / 20);
+}
 
 void clear_display(void)
 {
@@ -144,7 +606,7 @@ main(void)
   ubasic_get_variable(2, &v, 0, NULL);
   assert(v.d.i == 108 && v.type == TYPE_INTEGER);
 
-  run(program_loop);
+  run_jit(program_loop, "aijk");
   ubasic_get_variable(0, &v, 0, NULL);
   assert(v.d.i == ((value_t)(126 * 126 * 10)) && v.type == TYPE_INTEGER);
 
@@ -158,6 +620,41 @@ main(void)
   ubasic_get_variable(25, &v, 0, NULL);
   assert(v.d.i == 123 && v.type == TYPE_INTEGER);
 
+  run(program_vars);
+  ubasic_get_variable(11, &v, 0, NULL);
+  assert(v.d.i == 7 && v.type == TYPE_INTEGER);
+  ubasic_get_variable(12, &v, 0, NULL);
+  assert(v.d.i == 8 && v.type == TYPE_INTEGER);
+
+  run_jit(program_jit, "abcisxyz");
+  /* and the compiled loops gave the right answer, not just the same one */
+  ubasic_get_variable(18, &v, 0, NULL);
+  assert(v.d.i == 13 && v.type == TYPE_INTEGER);
+
+  run_two(program_fibs, program_peek_poke);
+
+  run_budget(program_slices, 1, 1000);
+  run_budget(program_slices, 7, 100);
+  run_budget(program_slices, 1000000, 0);
+  run_budget_error(program_divzero);
+
+  run_temps(program_temps);
+  run_heap(program_heap);
+  run_append(program_append);
+  run_views(program_views);
+  run_instr(program_instr);
+  run_long(program_long);
+  run_arrays(program_arrays);
+  run_budget_error(program_subscript);
+  run_budget_error(program_nodim);
+  run_budget_error(program_nodim_str);
+  run_budget_error(program_next);
+  run_output(program_print, "n=12    A\n   -4\n");
+  run_input(program_input);
+
+  tokenize_bench();
+  instr_bench();
+
   return 0;
 }
 /*---------------------------------------------------------------------------*/
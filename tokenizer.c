@@ -43,15 +43,23 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <setjmp.h>
+#ifdef UBASIC_THREADS
+#include <pthread.h>
+#endif
 
 #include "ubasic.h"
 #include "tokenizer.h"
 
-static char const *ptr, *nextptr;
-static char const *saved_ptr, *saved_next;
-static int saved_token;
+/* The program is converted once by tokenizer_init() into a compact token
+   stream. ptr/nextptr in the current struct tokenizer walk that stream,
+   src/srcnext walk the source text while it is being converted */
+static struct tokenizer tokenizer_default;
+static UBASIC_TLS struct tokenizer *tz = &tokenizer_default;
+
+static UBASIC_TLS char const *src, *srcnext;
+static UBASIC_TLS int src_num;		/* Value of a TOKENIZER_NUMBER at src */
 
-extern jmp_buf exception;
+extern UBASIC_TLS jmp_buf exception;
 #define exit(x) longjmp(exception, x)
 
 #define MAX_NUMLEN 6
@@ -61,7 +69,7 @@ struct keyword_token {
   int token;
 };
 
-uint8_t current_token = TOKENIZER_ERROR;
+UBASIC_TLS uint8_t current_token = TOKENIZER_ERROR;
 
 static const struct keyword_token keywords[] = {
   {"let", TOKENIZER_LET},
@@ -80,6 +88,7 @@ static const struct keyword_token keywords[] = {
   {"rem", TOKENIZER_REM},
   {"poke", TOKENIZER_POKE},
   {"peek", TOKENIZER_PEEK},
+  {"instr", TOKENIZER_INSTR},
   {"int", TOKENIZER_INT},
   {"abs", TOKENIZER_ABS},
   {"sgn", TOKENIZER_SGN},
@@ -108,126 +117,308 @@ static const struct keyword_token keywords[] = {
   {NULL, TOKENIZER_ERROR}
 };
 
+#define NUM_KEYWORDS	(sizeof(keywords) / sizeof(keywords[0]) - 1)
+
+/* The keywords grouped by their first letter so that a word is only
+   compared against those it could be. None is a prefix of another so the
+   order within a group does not matter */
+static uint8_t keyword_order[NUM_KEYWORDS];
+static uint8_t keyword_len[NUM_KEYWORDS];
+static uint8_t keyword_start[27];	/* Group n is start[n] to start[n+1] */
+
+/* What each character can start, so get_next_token() can go straight to
+   the right case */
+#define C_OTHER		0
+#define C_END		1
+#define C_DIGIT		2
+#define C_MINUS		3	/* A symbol or a negative number */
+#define C_PAIR		4	/* A symbol or the start of >= <= <> ** */
+#define C_SYMBOL	5	/* The token is the character itself */
+#define C_QUOTE		6
+#define C_LETTER	7
+
+static uint8_t char_class[256];
+
+#define IS_DIGIT(c)	(char_class[(uint8_t)(c)] == C_DIGIT)
+
+/*---------------------------------------------------------------------------*/
+static void tables_build(void)
+{
+  uint8_t fill[26];
+  unsigned int i, l;
+  const char *p;
+
+  char_class[0] = C_END;
+  for (i = '0'; i <= '9'; i++)
+    char_class[i] = C_DIGIT;
+  for (i = 'a'; i <= 'z'; i++)
+    char_class[i] = char_class[i - 0x20] = C_LETTER;
+  for (p = "\n,;+&|/(#)=^:?"; *p; p++)
+    char_class[(uint8_t)*p] = C_SYMBOL;
+  char_class['<'] = char_class['>'] = char_class['*'] = C_PAIR;
+  char_class['-'] = C_MINUS;
+  char_class['"'] = C_QUOTE;
+
+  for (i = 0; i < NUM_KEYWORDS; i++)
+    keyword_start[*keywords[i].keyword - 'a' + 1]++;
+  for (l = 0; l < 26; l++) {
+    keyword_start[l + 1] += keyword_start[l];
+    fill[l] = keyword_start[l];
+  }
+  for (i = 0; i < NUM_KEYWORDS; i++) {
+    keyword_order[fill[*keywords[i].keyword - 'a']++] = i;
+    keyword_len[i] = strlen(keywords[i].keyword);
+  }
+}
+
+/* Shared by every thread so they must only be built once */
+static void tokenizer_tables(void)
+{
+#ifdef UBASIC_THREADS
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, tables_build);
+#else
+  if (!keyword_start[26])
+    tables_build();
+#endif
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t keyword(void)
+{
+  unsigned int i, k, l;
+
+  l = (*src | 0x20) - 'a';
+  if (l >= 26)
+    return 0;
+  for (i = keyword_start[l]; i < keyword_start[l + 1]; i++) {
+    k = keyword_order[i];
+    if (strncasecmp(src + 1, keywords[k].keyword + 1, keyword_len[k] - 1) == 0) {
+      srcnext = src + keyword_len[k];
+      return keywords[k].token;
+    }
+  }
+  return 0;
+}
 /*---------------------------------------------------------------------------*/
 static uint8_t doublechar(void)
 {
   /* Special case the paired single char symbols */
-  if (*ptr == '>' && ptr[1] == '=')
+  if (*src == '>' && src[1] == '=')
     return TOKENIZER_GE;
-  if (*ptr == '<' && ptr[1] == '=')
+  if (*src == '<' && src[1] == '=')
     return TOKENIZER_LE;
-  if (*ptr == '<' && ptr[1] == '>')
+  if (*src == '<' && src[1] == '>')
     return TOKENIZER_NE;
-  if (*ptr == '*' && ptr[1] == '*')
+  if (*src == '*' && src[1] == '*')
     return TOKENIZER_POWER;
   return 0;
 }
-
-/*---------------------------------------------------------------------------*/
-static uint8_t singlechar(void)
-{
-  if (strchr("\n,;+-&|*/(#)<>=^:?", *ptr))
-    return *ptr;
-  /* Not semantically meaningful */
-  return 0;
-}
 /*---------------------------------------------------------------------------*/
 static uint8_t get_next_token(void)
 {
-  struct keyword_token const *kt;
   int i;
   uint8_t t;
 
-  DEBUG_PRINTF("get_next_token(): '%s'\n", ptr);
+  DEBUG_PRINTF("get_next_token(): '%s'\n", src);
 
-  if(*ptr == 0) {
+  switch(char_class[(uint8_t)*src]) {
+  case C_END:
     return TOKENIZER_ENDOFINPUT;
-  }
-
-  if ((isdigit(*ptr)) || (*ptr == '-' && isdigit(ptr[1]))) {
-    i = 0;
-    if (*ptr == '-')
-      i = 1;
+  case C_MINUS:
+    if (!IS_DIGIT(src[1])) {
+      srcnext = src + 1;
+      return *src;
+    }
+    /* Fall through */
+  case C_DIGIT:
+    /* Work out the value on the way, the token stream keeps it */
+    i = *src == '-';
+    src_num = 0;
     for(; i < MAX_NUMLEN; ++i) {
-      if(!isdigit(ptr[i])) {
-        if(i > 0) {
-          nextptr = ptr + i;
-          return TOKENIZER_NUMBER;
-        } else {
-          DEBUG_PRINTF("get_next_token: error due to too short number\n");
-          return TOKENIZER_ERROR;
-        }
-      }
-      if(!isdigit(ptr[i])) {
-        DEBUG_PRINTF("get_next_token: error due to malformed number\n");
-        return TOKENIZER_ERROR;
+      if(!IS_DIGIT(src[i])) {
+        srcnext = src + i;
+        if (*src == '-')
+          src_num = -src_num;
+        return TOKENIZER_NUMBER;
       }
+      src_num = src_num * 10 + src[i] - '0';
     }
     DEBUG_PRINTF("get_next_token: error due to too long number\n");
     return TOKENIZER_ERROR;
-  } else if((t = doublechar()) != 0) {
-    nextptr = ptr + 2;
-    return t;
-  } else if((t = singlechar()) != 0) {
-    nextptr = ptr + 1;
-    return t;
-  } else if(*ptr == '"') {
-    nextptr = ptr;
+  case C_PAIR:
+    if ((t = doublechar()) != 0) {
+      srcnext = src + 2;
+      return t;
+    }
+    /* Fall through */
+  case C_SYMBOL:
+    srcnext = src + 1;
+    return *src;
+  case C_QUOTE:
+    srcnext = src;
     do {
-      ++nextptr;
-      if (!*nextptr || *nextptr == '\n')
-        ubasic_tokenizer_error();
-    } while(*nextptr != '"');
-    ++nextptr;
+      ++srcnext;
+      /* Unterminated strings are reported when the line is run */
+      if (!*srcnext || *srcnext == '\n')
+        return TOKENIZER_ERROR;
+    } while(*srcnext != '"');
+    ++srcnext;
     return TOKENIZER_STRING;
-  } else {
-    for(kt = keywords; kt->keyword != NULL; ++kt) {
-      if(strncasecmp(ptr, kt->keyword, strlen(kt->keyword)) == 0) {
-        nextptr = ptr + strlen(kt->keyword);
-        return kt->token;
-      }
-    }
-  }
-
-  if ((*ptr >= 'a' && *ptr <= 'z') || (*ptr >= 'A' && *ptr <= 'Z')) {
-    nextptr = ptr + 1;
-    if (*nextptr == '$') {
-      nextptr++;
+  case C_LETTER:
+    if ((t = keyword()) != 0)
+      return t;
+    srcnext = src + 1;
+    if (*srcnext == '$') {
+      srcnext++;
       return TOKENIZER_STRINGVAR;
     }
-    if (isdigit(*nextptr))	/* A0-A9/B0-B9/etc */
-      nextptr++;
+    if (IS_DIGIT(*srcnext))	/* A0-A9/B0-B9/etc */
+      srcnext++;
     return TOKENIZER_INTVAR;
   }
-
-
   return TOKENIZER_ERROR;
 }
 /*---------------------------------------------------------------------------*/
+/* Token stream encoding. Every token is one byte, numbers and variables are
+   followed by a 16bit little endian value and strings by a 16bit length and
+   the bytes of the string. Strings also have a string value's length
+   (STRING_HDR bytes) in front of the bytes so that they can be used as
+   string values where they are */
+static unsigned int get16(char const *p)
+{
+  return (uint8_t)p[0] | ((uint8_t)p[1] << 8);
+}
+/*---------------------------------------------------------------------------*/
+static void emit(uint8_t c)
+{
+  if (tz->tokens)
+    tz->tokens[tz->tokens_len] = c;
+  tz->tokens_len++;
+}
+/*---------------------------------------------------------------------------*/
+static void emit16(unsigned int v)
+{
+  emit(v);
+  emit(v >> 8);
+}
+/*---------------------------------------------------------------------------*/
+static int variable_num(void)
+{
+  if (src[1] == '$')
+    return STRINGFLAG | (toupper(*src) - 'A');
+  /* FIXME: hard code to use &~0x20 as we already know it is a letter */
+  if (!IS_DIGIT(src[1]))
+    return toupper(*src) - 'A';
+  else {
+    /* One day we'll need long vars and brains, until then..
+       A0-Z9 follow on after A-Z */
+    return 26 + (toupper(*src) - 'A') * 10 + src[1] - '0';
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void tokenize(const char *program, linefunc_t func)
+{
+  uint8_t t;
+  int len;
+  uint8_t sol = 1;
+
+  tz->tokens_len = 0;
+  src = program;
+  do {
+    while(*src == ' ')
+      src++;
+    t = get_next_token();
+    /* Report each line start as it goes by so nobody has to go looking */
+    if (sol && t == TOKENIZER_NUMBER && tz->tokens)
+      func(src_num, (char const *)tz->tokens + tz->tokens_len);
+    sol = (t == TOKENIZER_CR);
+    emit(t);
+    switch(t) {
+    case TOKENIZER_NUMBER:
+      emit16(src_num);
+      break;
+    case TOKENIZER_INTVAR:
+    case TOKENIZER_STRINGVAR:
+      emit16(variable_num());
+      break;
+    case TOKENIZER_STRING:
+      len = srcnext - src - 2;
+      emit16(len);
+      emit(len);
+      if (STRING_HDR == 2)
+        emit(len >> 8);
+      while(len--)
+        emit(*++src);
+      break;
+    case TOKENIZER_REM:
+    case TOKENIZER_ERROR:
+      /* Comments are dropped, and so is the rest of a line we could not
+         make sense of. The error token reports it if the line is run */
+      srcnext = src;
+      while(*srcnext && *srcnext != '\n')
+        srcnext++;
+      break;
+    }
+    src = srcnext;
+  } while(t != TOKENIZER_ENDOFINPUT);
+  /* Pad so that reading a value after the final token stays in bounds */
+  emit16(0);
+}
+/*---------------------------------------------------------------------------*/
+static char const *token_end(char const *p)
+{
+  switch((uint8_t)*p) {
+  case TOKENIZER_NUMBER:
+  case TOKENIZER_INTVAR:
+  case TOKENIZER_STRINGVAR:
+  case TOKENIZER_LINEREF:
+    return p + 3;
+  case TOKENIZER_STRING:
+    return p + 3 + STRING_HDR + get16(p + 1);
+  }
+  return p + 1;
+}
+/*---------------------------------------------------------------------------*/
+void tokenizer_use(struct tokenizer *t)
+{
+  tz = t;
+  current_token = t->ptr ? *t->ptr : TOKENIZER_ERROR;
+}
+/*---------------------------------------------------------------------------*/
 void tokenizer_goto(const char *program)
 {
-  ptr = program;
-  current_token = get_next_token();
+  tz->ptr = program;
+  current_token = *tz->ptr;
+  tz->nextptr = token_end(tz->ptr);
 }
 /*---------------------------------------------------------------------------*/
-void tokenizer_init(const char *program)
+void tokenizer_init(const char *program, linefunc_t func)
 {
-  tokenizer_goto(program);
-  current_token = get_next_token();
+  free(tz->tokens);
+  tz->tokens = NULL;
+  tokenizer_tables();
+  /* Size the token stream on the first pass and fill it on the second */
+  tokenize(program, func);
+  tz->tokens = malloc(tz->tokens_len);
+  if (tz->tokens == NULL)
+    ubasic_error("Out of memory");
+  tokenize(program, func);
+  DEBUG_PRINTF("tokenizer_init: %u bytes of tokens\n", tz->tokens_len);
+  tokenizer_goto((char const *)tz->tokens);
 }
 /*---------------------------------------------------------------------------*/
 void tokenizer_push(void)
 {
-  saved_ptr = ptr;
-  saved_next = nextptr;
-  saved_token = current_token;
+  tz->saved_ptr = tz->ptr;
+  tz->saved_next = tz->nextptr;
+  tz->saved_token = current_token;
 }
 /*---------------------------------------------------------------------------*/
 void tokenizer_pop(void)
 {
-  ptr = saved_ptr;
-  nextptr = saved_next;
-  current_token = saved_token;
+  tz->ptr = tz->saved_ptr;
+  tz->nextptr = tz->saved_next;
+  current_token = tz->saved_token;
 }
 /*---------------------------------------------------------------------------*/
 void tokenizer_next(void)
@@ -237,15 +428,12 @@ void tokenizer_next(void)
     return;
   }
 
-  DEBUG_PRINTF("tokenizer_next: %p\n", nextptr);
-  ptr = nextptr;
-
-  while(*ptr == ' ') {
-    ++ptr;
-  }
-  current_token = get_next_token();
+  DEBUG_PRINTF("tokenizer_next: %p\n", tz->nextptr);
+  tz->ptr = tz->nextptr;
+  current_token = *tz->ptr;
+  tz->nextptr = token_end(tz->ptr);
 
-  DEBUG_PRINTF("tokenizer_next: '%s' %d\n", ptr, current_token);
+  DEBUG_PRINTF("tokenizer_next: %d\n", current_token);
   return;
 }
 
@@ -253,56 +441,76 @@ void tokenizer_next(void)
 
 void tokenizer_newline(void)
 {
-   while(!(*nextptr == '\n' || tokenizer_finished())) {
-     ++nextptr;
-  }
-  tokenizer_next();
+  while(current_token != TOKENIZER_CR && !tokenizer_finished())
+    tokenizer_next();
 }
 
 /*---------------------------------------------------------------------------*/
 value_t tokenizer_num(void)
 {
-  return atoi(ptr);
+  return get16(tz->ptr + 1);
 }
 /*---------------------------------------------------------------------------*/
 int tokenizer_string_len(void)
 {
-  char *string_end;
-
   if(current_token != TOKENIZER_STRING) {
     write(2, "strlbotch\n", 10);
     exit(1);
   }
-  string_end = strchr(ptr + 1, '"');
-  /* Pass -1 back so we can keep the notional split between the tokenizer
-     and core code cleaner */
-  if(string_end == NULL)
-    ubasic_tokenizer_error();
-  return string_end - ptr - 1;
+  return get16(tz->ptr + 1);
 }
 
 /*---------------------------------------------------------------------------*/
 char const *tokenizer_string(void)
 {
-  return ptr + 1;
+  return tz->ptr + 3 + STRING_HDR;
+}
+/*---------------------------------------------------------------------------*/
+/* The literal as a string value, or NULL if it is too long for one */
+uint8_t const *tokenizer_string_view(void)
+{
+  if (get16(tz->ptr + 1) > STRING_MAX)
+    return NULL;
+  return (uint8_t const *)tz->ptr + 3;
 }
 
 /*---------------------------------------------------------------------------*/
 void tokenizer_string_func(stringfunc_t func, void *ctx)
 {
-  const char *string_end, *p;
+  const char *p;
+  int len;
 
   if(current_token != TOKENIZER_STRING) {
     return;
   }
-  p = ptr + 1;
-  string_end = strchr(p, '"');
-  if(string_end == NULL)
-    ubasic_tokenizer_error();
-  while(p != string_end)
+  p = tz->ptr + 3 + STRING_HDR;
+  len = get16(tz->ptr + 1);
+  while(len--)
     func(*p++, ctx);
 }
 
+/*---------------------------------------------------------------------------*/
+void tokenizer_resolve(char const *pos, char const *target)
+{
+  uint8_t *p = tz->tokens + (pos - (char const *)tz->tokens);
+  unsigned int off = target - (char const *)tz->tokens;
+
+  /* Turn the number token at pos into a reference to target. It is the
+     same size so the stream does not move. Anything out of reach of the
+     16bit offset is just left as a line number */
+  if (*p != TOKENIZER_NUMBER || off > 0xFFFF)
+    return;
+  p[0] = TOKENIZER_LINEREF;
+  p[1] = off;
+  p[2] = off >> 8;
+}
+
+/*---------------------------------------------------------------------------*/
+char const *tokenizer_target(void)
+{
+  return (char const *)tz->tokens + get16(tz->ptr + 1);
+}
+
 /*---------------------------------------------------------------------------*/
 void tokenizer_error_print(void)
 {
@@ -311,23 +519,29 @@ void tokenizer_error_print(void)
 /*---------------------------------------------------------------------------*/
 int tokenizer_finished(void)
 {
-  return *ptr == 0 || current_token == TOKENIZER_ENDOFINPUT;
+  return current_token == TOKENIZER_ENDOFINPUT;
 }
 /*---------------------------------------------------------------------------*/
 int tokenizer_variable_num(void)
 {
-  if (ptr[1] == '$')
-    return STRINGFLAG | (toupper(*ptr) - 'A');
-  /* FIXME: hard code to use &~0x20 as we already know it is a letter */
-  if (!isdigit(ptr[1]))
-    return toupper(*ptr) - 'A';
-  else {
-    /* One day we'll need long vars and brains, until then.. */
-    return (toupper(*ptr) - '@') * 11 + ptr[1] - '0';
-  }
+  return get16(tz->ptr + 1);
 }
 /*---------------------------------------------------------------------------*/
 char const *tokenizer_pos(void)
 {
-    return ptr;
+    return tz->ptr;
+}
+/*---------------------------------------------------------------------------*/
+/* The end of the current token, so that coming back to it later with
+   tokenizer_resume() needs no decoding */
+char const *tokenizer_pos_next(void)
+{
+  return tz->nextptr;
+}
+/*---------------------------------------------------------------------------*/
+void tokenizer_resume(char const *pos, char const *next)
+{
+  tz->ptr = pos;
+  current_token = *tz->ptr;
+  tz->nextptr = next;
 }
@@ -67,6 +67,7 @@
 #define TOKENIZER_OR		((uint8_t)159)
 #define TOKENIZER_AT		((uint8_t)160)
 #define TOKENIZER_CLS		((uint8_t)161)
+#define TOKENIZER_LINEREF	((uint8_t)162)	/* Resolved GO TO/SUB target */
 #define TOKENIZER_NUMBER	((uint8_t)192)	/* Numeric expression types */
 #define TOKENIZER_INTVAR	((uint8_t)193)
 #define TOKENIZER_PEEK		((uint8_t)194)
@@ -76,6 +77,7 @@
 #define TOKENIZER_LEN		((uint8_t)198)
 #define TOKENIZER_CODE		((uint8_t)199)
 #define TOKENIZER_VAL		((uint8_t)200)
+#define TOKENIZER_INSTR		((uint8_t)201)
 #define TOKENIZER_STRING	((uint8_t)224)	/* String expression types */
 #define TOKENIZER_STRINGVAR	((uint8_t)225)
 #define TOKENIZER_LEFTSTR	((uint8_t)226)
@@ -102,6 +104,33 @@
 #define TOKENIZER_QUESTION 	((uint8_t)'?')
 #define TOKENIZER_CR		((uint8_t)'\n')
 
+/* Ops of the bytecode engine (UBASIC_VM). Compiled expressions use the
+   operator tokens themselves, statements use tokens that never appear in
+   an expression, with any operands following them */
+#define OP_LINE		TOKENIZER_CR		/* line16: start of a line */
+#define OP_END		TOKENIZER_ELSE		/* End of the program */
+#define OP_STMT		TOKENIZER_REM		/* tok16: parse a statement */
+#define OP_EXPR		TOKENIZER_CALL		/* tok16 end: parse an expression */
+#define OP_STORE	TOKENIZER_LET		/* var16: pop into a variable */
+#define OP_ASTORE	TOKENIZER_DIM		/* var16 n: pop into an element */
+#define OP_JZ		TOKENIZER_IF		/* addr16: pop, branch if zero */
+#define OP_JMP		TOKENIZER_GO		/* addr16 */
+#define OP_GOSUB	TOKENIZER_SUB		/* addr16 */
+#define OP_GOTOX	TOKENIZER_TO		/* Pop a line number to go to */
+#define OP_GOSUBX	TOKENIZER_THEN		/* Pop a line number to go sub */
+#define OP_RETURN	TOKENIZER_RETURN
+#define OP_FOR		TOKENIZER_FOR		/* var16: pop the step and limit */
+#define OP_NEXT		TOKENIZER_NEXT		/* var16 */
+#define OP_STOP		TOKENIZER_STOP
+#define OP_SYNTAX	TOKENIZER_ERROR
+
+/* Limits of the bytecode engine, the same for the C ubc writes from it */
+#define MAX_GOSUB_STACK_DEPTH	10
+#define MAX_FOR_STACK_DEPTH	4
+#define MAX_ARRAY		26	/* A-Z can be arrays */
+#define MAX_CODE_SUBSCRIPT	2	/* Most subscripts code passes */
+#define MAX_EXPR_STACK		16
+
 
 #define TOKENIZER_NUMEXP(x)		(((x) & 0xE0) == 0xC0)
 #define TOKENIZER_STRINGEXP(x)		(((x) & 0xE0) == 0xE0)
@@ -109,22 +138,38 @@
 #define STRINGFLAG	0x8000
 #define ARRAYFLAG	0x4000
 
+/* Where one program's token stream is and how far through it we are */
+struct tokenizer {
+  char const *ptr, *nextptr;
+  char const *saved_ptr, *saved_next;
+  int saved_token;
+  uint8_t *tokens;
+  unsigned int tokens_len;
+};
+
 typedef void (*stringfunc_t)(char c, void *ctx);
+typedef void (*linefunc_t)(line_t line, char const *pos);
+void tokenizer_use(struct tokenizer *t);
 void tokenizer_goto(const char *program);
-void tokenizer_init(const char *program);
+void tokenizer_init(const char *program, linefunc_t func);
 void tokenizer_next(void);
 void tokenizer_newline(void);
-extern uint8_t current_token;
+extern UBASIC_TLS uint8_t current_token;
 value_t tokenizer_num(void);
 int tokenizer_variable_num(void);
 char const *tokenizer_string(void);
+uint8_t const *tokenizer_string_view(void);
 int tokenizer_string_len(void);
 void tokenizer_string_func(stringfunc_t func, void *ctx);
+void tokenizer_resolve(char const *pos, char const *target);
+char const *tokenizer_target(void);
 void tokenizer_push(void);
 void tokenizer_pop(void);
 int tokenizer_finished(void);
 void tokenizer_error_print(void);
 
 char const *tokenizer_pos(void);
+char const *tokenizer_pos_next(void);
+void tokenizer_resume(char const *pos, char const *next);
 
 #endif /* __TOKENIZER_H__ */
@@ -46,79 +46,248 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <setjmp.h>
+#include <limits.h>
 
 #include "ubasic.h"
 #include "tokenizer.h"
 
-jmp_buf exception;
-#define exit(x) longjmp(exception, x)
+/* Hot FOR loops are compiled to native code on x86-64 unless built with
+   UBASIC_NO_JIT. The bytecode engine has its own NEXT so does without */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(UBASIC_NO_JIT) && \
+    !defined(UBASIC_VM)
+#define UBASIC_JIT
+#include <stddef.h>
+#include <sys/mman.h>
+#endif
 
-static char const *program_ptr;
+/* String search and comparison look at a vector of bytes at a time where
+   the compiler has SSE2 (always on x86-64) or AVX2 */
+#if defined(__AVX2__) && defined(__GNUC__)
+#include <immintrin.h>
+#define VEC		32
+#define vec_t		__m256i
+#define vec_load(p)	_mm256_loadu_si256((const __m256i *)(p))
+#define vec_splat(c)	_mm256_set1_epi8(c)
+#define vec_eq(a, b)	((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)))
+#elif defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define VEC		16
+#define vec_t		__m128i
+#define vec_load(p)	_mm_loadu_si128((const __m128i *)(p))
+#define vec_splat(c)	_mm_set1_epi8(c)
+#define vec_eq(a, b)	((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)))
+#endif
 
-#define MAX_GOSUB_STACK_DEPTH 10
-static char const *gosub_stack[MAX_GOSUB_STACK_DEPTH];
-static int gosub_stack_ptr;
+UBASIC_TLS jmp_buf exception;
+#define exit(x) longjmp(exception, x)
 
 struct for_state {
   char const *resume_token;	/* Token to resume execution at */
+  char const *resume_next;	/* and the token after it */
+  value_t *var;			/* Where for_variable lives */
   var_t for_variable;
   value_t to;
   value_t step;
 };
 
-#define MAX_FOR_STACK_DEPTH 4
-static struct for_state for_stack[MAX_FOR_STACK_DEPTH];
-static int for_stack_ptr;
-
+/* Sorted by line number, built when the program is loaded */
 struct line_index {
   line_t line_number;
   char const *program_text_position;
-  struct line_index *next;
 };
-struct line_index *line_index_head = NULL;
-struct line_index *line_index_current = NULL;
+
+/* Compiled expressions, see cexpr() */
+struct expr_cache {
+  char const *pos;		/* Token position the expression starts at */
+  char const *end;		/* Token position following it */
+  uint8_t *code;		/* Compiled form or NULL if it must be parsed */
+};
+
+#ifdef UBASIC_JIT
+#define MAX_JIT_LOOPS	16
+
+/* Returns 0 if it stopped early because the budget ran out */
+typedef int (*jit_func)(int *stack, struct for_state *fs, value_t *vars);
+
+/* Compiled loops, see jit_run() */
+struct jit_loop {
+  char const *resume;		/* Start of the body */
+  char const *next;		/* Variable of the NEXT that closes it */
+  unsigned int count;
+  union {
+    void *p;			/* NULL until compiled, or if it cannot be */
+    jit_func f;
+  } code;
+  size_t size;
+};
+#endif
+
+/* Temporary strings last until the next statement. They are bump allocated
+   from a chain of chunks, see string_temp(). A string too long for one gets
+   a chunk of its own size */
+#define STRING_CHUNK	512
+
+struct string_chunk {
+  struct string_chunk *next;
+  unsigned int size;
+  uint8_t data[STRING_CHUNK];	/* or size if more */
+};
+
+/* Strings held in variables come from slabs, each cut into blocks of one
+   size class: 16 bytes for class 0 doubling up to 512. A block is the class
+   byte followed by the string itself, so a value can be replaced in place
+   whenever the new one fits. Blocks of the larger classes that long
+   strings need are each a slab of their own */
+#define STRING_CLASSES	6
+#ifdef UBASIC_LONG_STRINGS
+#define STRING_BIG_CLASSES	13
+#else
+#define STRING_BIG_CLASSES	STRING_CLASSES
+#endif
+#define STRING_SLAB	1024
+
+struct string_slab {
+  struct string_slab *next;
+  uint8_t data[STRING_SLAB];	/* or one block of a big class */
+};
+
+/* Longest line INPUT reads */
+#ifdef UBASIC_LONG_STRINGS
+#define INPUT_MAX	4096
+#else
+#define INPUT_MAX	128
+#endif
 
 #define MAX_VARNUM 26 * 11
-#define MAX_SUBSCRIPT 2
+#define MAX_SUBSCRIPT 4
 #define MAX_STRING 26
-#define MAX_ARRAY 26
-static value_t variables[MAX_VARNUM];
-static uint8_t *vararrays[MAX_ARRAY];	/* Could union with variables FIXME ?*/
-static value_t variablesubs[MAX_ARRAY];
-static value_t vardim[MAX_ARRAY][MAX_SUBSCRIPT];
-static uint8_t *strings[MAX_STRING];
-static value_t stringsubs[MAX_STRING];
-static value_t stringdim[MAX_STRING][MAX_SUBSCRIPT];
-static uint8_t nullstr[1] = { 0 };
-
-static int ended;
+
+/* A DIMmed array. The elements follow this header, row major so that the
+   last subscript steps between neighbours. DIM works out how far apart
+   each subscript's elements are so a lookup is only multiplies and adds */
+struct array {
+  union {
+    value_t *i;
+    uint8_t **s;
+  } e;
+  unsigned int size;			/* Number of elements */
+  unsigned int stride[MAX_SUBSCRIPT];
+  value_t top[MAX_SUBSCRIPT];		/* Highest subscript of each */
+  uint8_t dims;
+};
+
+/* Everything about one loaded program. The API works on whichever was last
+   passed to ubasic_use(), a default one until then */
+struct ubasic {
+  struct tokenizer tokenizer;
+  char const *program_ptr;
+  line_t line_num;
+  int ended;
+  uint8_t failed;		/* Stopped by an error in ubasic_run_budget() */
+  uint8_t mid_line;		/* Next statement is not at the start of a line */
+  long budget;			/* Statements left before ubasic_run_budget() yields */
+  uint8_t one_line;		/* ubasic_run(): only line starts use the budget */
+
+  /* INPUT lines given by ubasic_input() rather than read, see input_line() */
+  uint8_t input_async;
+  uint8_t waiting;		/* Stopped at an INPUT for a line */
+  uint8_t input_ready;		/* A line has been given */
+  char const *input_resume;	/* The variable it stopped at */
+  int input_len;		/* Length of the line given, -1 for EOF */
+  char input_buf[INPUT_MAX];
+
+  char const *gosub_stack[MAX_GOSUB_STACK_DEPTH];
+  int gosub_stack_ptr;
+  struct for_state for_stack[MAX_FOR_STACK_DEPTH];
+  int for_stack_ptr;
+
+  /* Sorted by line number, built when the program is loaded */
+  struct line_index *line_index;
+  unsigned int line_index_len;
+
+  value_t variables[MAX_VARNUM];
+  struct array *arrays[MAX_ARRAY];	/* A-Z once DIMmed */
+  uint8_t *strings[MAX_STRING];
+  struct array *string_arrays[MAX_STRING];
+  /* Set when the program is loaded for each of A-Z it never subscripts, so
+     that it cannot become an array. A0-Z9 never can */
+  uint8_t var_plain[MAX_ARRAY];
+
+  struct string_chunk temp;	/* First chunk of temporary strings */
+  struct string_chunk *temp_chunk;	/* The one in use */
+  uint8_t *nextstr;
+  unsigned int temp_used;	/* Bytes taken by this statement */
+  unsigned int temp_high;	/* and the most any has taken */
+  unsigned int temp_chunks;
+  struct string_slab *slabs;
+  uint8_t *string_free[STRING_BIG_CLASSES];	/* Free blocks of each class */
+  unsigned int heap_size;
+  unsigned int heap_used;
+
+  peek_func peek_function;
+  poke_func poke_function;
+  output_func output;		/* NULL for the screen */
+  void *output_ctx;
+  int chpos;			/* Output column */
+  const char *data_position;
+  int data_seek;
+  unsigned int array_base;
+
+  struct expr_cache *expr_cache;
+  unsigned int expr_cache_size;	/* Power of two */
+  unsigned int expr_cache_used;
+
+#ifdef UBASIC_VM
+  /* The whole program compiled for run_code(), see vm_compile() */
+  uint8_t *vm_code;
+  unsigned int vm_len;
+  unsigned int vm_size;
+  uint8_t vm_failed;
+  uint16_t *vm_lines;		/* Code offset of each line_index entry */
+  uint8_t const *vm_pc;		/* Where run_code() yielded, NULL to start */
+#endif
+#ifdef UBASIC_JIT
+  struct jit_loop jit_loops[MAX_JIT_LOOPS];
+  unsigned int jit_used;
+#endif
+};
+
+static struct ubasic ubasic_default;
+static UBASIC_TLS struct ubasic *ub = &ubasic_default;
+
+static uint8_t nullstr[STRING_HDR] = { 0 };
 
 static void expr(struct typevalue *val);
-static void line_statements(void);
+static void statement_step(void);
 void statements(void);
 static uint8_t statementgroup(void);
 static uint8_t statement(void);
 static void index_free(void);
-
-peek_func peek_function = NULL;
-poke_func poke_function = NULL;
-
-line_t line_num;
-static const char *data_position;
-static int data_seek;
-
-static unsigned int array_base = 0;
+static void expr_cache_free(void);
+static void string_temp_free(void);
+static void string_release(uint8_t *p);
+static void array_free(struct array **ap, uint8_t strings);
+#ifdef UBASIC_JIT
+static void jit_free(void);
+#endif
+static void index_add(line_t linenum, char const *pos);
+static int index_slot(int linenum);
+static void resolve_jumps(void);
+static void resolve_variables(void);
+#ifdef UBASIC_VM
+static void vm_compile(void);
+#endif
 
 const char *_itoa(int v)
 {
-  static char buf[16];
+  static UBASIC_TLS char buf[16];
   snprintf(buf, 16, "%d", v);
   return buf;
 }
 
 const char *_uitoa(int v)
 {
-  static char buf[16];
+  static UBASIC_TLS char buf[16];
   snprintf(buf, 16, "%u", v);
   return buf;
 }
@@ -127,30 +296,124 @@ const char *_uitoa(int v)
 void ubasic_init(const char *program)
 {
   int i;
-  program_ptr = program;
-  for_stack_ptr = gosub_stack_ptr = 0;
+  ub->for_stack_ptr = ub->gosub_stack_ptr = 0;
+  ub->line_num = 0;
+  tokenizer_use(&ub->tokenizer);
   index_free();
-  tokenizer_init(program);
-  data_position = program_ptr;
-  data_seek = 1;
-  ended = 0;
+  expr_cache_free();
+#ifdef UBASIC_JIT
+  jit_free();
+#endif
+  for (i = 0; i < MAX_ARRAY; i++)
+    array_free(&ub->arrays[i], 0);
   for (i = 0; i < MAX_STRING; i++)
-    strings[i] = nullstr;
+    array_free(&ub->string_arrays[i], 1);
+  tokenizer_init(program, index_add);
+  ub->program_ptr = tokenizer_pos();
+  resolve_jumps();
+  resolve_variables();
+#ifdef UBASIC_VM
+  vm_compile();
+  ub->vm_pc = NULL;
+#endif
+  ub->data_position = ub->program_ptr;
+  ub->data_seek = 1;
+  ub->ended = 0;
+  ub->failed = 0;
+  ub->mid_line = 0;
+  ub->one_line = 0;
+  ub->waiting = ub->input_ready = 0;
+  ub->input_resume = NULL;
+  string_temp_free();
+  for (i = 0; i < MAX_STRING; i++) {
+    /* NULL only before the default instance is first used */
+    if (ub->strings[i])
+      string_release(ub->strings[i]);
+    ub->strings[i] = nullstr;
+  }
 }
 /*---------------------------------------------------------------------------*/
 void ubasic_init_peek_poke(const char *program, peek_func peek, poke_func poke)
 {
-  peek_function = peek;
-  poke_function = poke;
+  ub->peek_function = peek;
+  ub->poke_function = poke;
   ubasic_init(program);
 }
 /*---------------------------------------------------------------------------*/
+struct ubasic *ubasic_new(void)
+{
+  struct ubasic *u = calloc(1, sizeof(struct ubasic));
+  int i;
+
+  if (u == NULL)
+    return NULL;
+  for (i = 0; i < MAX_STRING; i++)
+    u->strings[i] = nullstr;
+  u->temp.size = STRING_CHUNK;
+  u->temp_chunk = &u->temp;
+  u->nextstr = u->temp.data;
+  return u;
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_output(output_func func, void *ctx)
+{
+  ub->output = func;
+  ub->output_ctx = ctx;
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_use(struct ubasic *u)
+{
+  ub = u ? u : &ubasic_default;
+  tokenizer_use(&ub->tokenizer);
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_free(struct ubasic *u)
+{
+  struct ubasic *old = ub;
+  struct string_chunk *c;
+  struct string_slab *s;
+  int i;
+
+  /* The helpers all work on the current instance */
+  ubasic_use(u);
+  index_free();
+  expr_cache_free();
+#ifdef UBASIC_JIT
+  jit_free();
+#endif
+#ifdef UBASIC_VM
+  free(u->vm_code);
+  free(u->vm_lines);
+#endif
+  free(u->tokenizer.tokens);
+  while ((c = u->temp.next) != NULL) {
+    u->temp.next = c->next;
+    free(c);
+  }
+  while ((s = u->slabs) != NULL) {
+    u->slabs = s->next;
+    free(s);
+  }
+  for (i = 0; i < MAX_ARRAY; i++)
+    free(u->arrays[i]);
+  /* The strings themselves went with the slabs */
+  for (i = 0; i < MAX_STRING; i++)
+    free(u->string_arrays[i]);
+  free(u);
+  ubasic_use(old == u ? NULL : old);
+}
+/*---------------------------------------------------------------------------*/
+line_t *ubasic_line(void)
+{
+  return &ub->line_num;
+}
+/*---------------------------------------------------------------------------*/
 void ubasic_error(const char *err)
 {
   const char *p;
   charout('\n', NULL);
-  if (line_num) {
-    p = _uitoa(line_num);
+  if (ub->line_num) {
+    p = _uitoa(ub->line_num);
     putstrz(p);
     putstrz(": ");
   }
@@ -164,6 +427,7 @@ static const char divzero[] = { "Division by zero" };
 static const char outofmemory[] = { "Out of memory" };
 static const char badsubscript[] = { "Subscript" };
 static const char redimension[] = { "Redimension" };
+static const char badline[] = { "Undefined line" };
 
 static void syntax_error(void)
 {
@@ -239,67 +503,312 @@ static void typecheck_same(struct typevalue *l, struct typevalue *r)
 static void range_check(struct typevalue *v, value_t top)
 {
   typecheck_int(v);
-  if (v->d.i > top || v->d.i < array_base)
+  if (v->d.i > top || v->d.i < ub->array_base)
     ubasic_error(badsubscript);
 }
 /*---------------------------------------------------------------------------*/
-/* Temoporary implementation of string workspaces */
+/* An array with subscripts 0 to top[n], elements zero or the empty string */
+static struct array *array_new(uint8_t dims, value_t *top, uint8_t strings)
+{
+  struct array *a;
+  unsigned int stride[MAX_SUBSCRIPT];
+  unsigned int size = 1;
+  size_t esize = strings ? sizeof(uint8_t *) : sizeof(value_t);
+  int n;
+
+  for (n = dims - 1; n >= 0; n--) {
+    if (top[n] < 0)
+      ubasic_error(badsubscript);
+    stride[n] = size;
+    if (size > UINT_MAX / esize / (top[n] + 1U))
+      ubasic_error(outofmemory);
+    size *= top[n] + 1U;
+  }
+  a = calloc(1, sizeof(struct array) + size * esize);
+  if (a == NULL)
+    ubasic_error(outofmemory);
+  a->e.i = (value_t *)(a + 1);
+  if (strings) {
+    a->e.s = (uint8_t **)(a + 1);
+    for (n = 0; n < (int)size; n++)
+      a->e.s[n] = nullstr;
+  }
+  a->size = size;
+  a->dims = dims;
+  memcpy(a->stride, stride, sizeof(stride));
+  memcpy(a->top, top, dims * sizeof(value_t));
+  return a;
+}
+/*---------------------------------------------------------------------------*/
+static void array_free(struct array **ap, uint8_t strings)
+{
+  struct array *a = *ap;
+  unsigned int i;
+
+  if (a == NULL)
+    return;
+  if (strings)
+    for (i = 0; i < a->size; i++)
+      string_release(a->e.s[i]);
+  free(a);
+  *ap = NULL;
+}
+/*---------------------------------------------------------------------------*/
+/* Which element the subscripts pick */
+static unsigned int array_index(struct array *a, int nsubs,
+                                struct typevalue *subs)
+{
+  unsigned int i = 0;
+  int n;
 
-static uint8_t stringblob[512];
-static uint8_t *nextstr;
+  if (a == NULL || a->dims != nsubs)
+    ubasic_error(badsubscript);
+  for (n = 0; n < nsubs; n++) {
+    range_check(subs + n, a->top[n]);
+    i += subs[n].d.i * a->stride[n];
+  }
+  return i;
+}
+/*---------------------------------------------------------------------------*/
+/* The length in front of a string */
+static unsigned int string_len(uint8_t const *p)
+{
+#ifdef UBASIC_LONG_STRINGS
+  return p[0] | (p[1] << 8);
+#else
+  return *p;
+#endif
+}
+/*---------------------------------------------------------------------------*/
+static void string_header(uint8_t *p, unsigned int len)
+{
+  *p = len;
+#ifdef UBASIC_LONG_STRINGS
+  p[1] = len >> 8;
+#endif
+}
+/*---------------------------------------------------------------------------*/
+/* String workspaces. A statement that runs out of a chunk moves on to the
+   next, adding one if need be. They are kept so later statements reuse
+   them without going back to malloc */
 
 static uint8_t *string_temp(int len)
 {
-  uint8_t *p = nextstr;
-  if (len > 255)
+  struct string_chunk *c = ub->temp_chunk;
+  struct string_chunk *n;
+  uint8_t *p = ub->nextstr;
+  unsigned int size = len + STRING_HDR;
+
+  if (len > STRING_MAX)
     ubasic_error("String too long");
-  nextstr += len + 1;
-  if (nextstr > stringblob + sizeof(stringblob))
-    ubasic_error("Out of temporary space");
-  *p = len;
+  if (p + size > c->data + c->size) {
+    n = c->next;
+    if (n == NULL || n->size < size) {
+      if (size < STRING_CHUNK)
+        size = STRING_CHUNK;
+      n = malloc(sizeof(struct string_chunk) - STRING_CHUNK + size);
+      if (n == NULL)
+        ubasic_error("Out of temporary space");
+      n->size = size;
+      n->next = c->next;
+      c->next = n;
+      ub->temp_chunks++;
+    }
+    ub->temp_chunk = c = n;
+    p = c->data;
+  }
+  ub->nextstr = p + len + STRING_HDR;
+  ub->temp_used += len + STRING_HDR;
+  string_header(p, len);
   return p;
 }
 /*---------------------------------------------------------------------------*/
 static void string_temp_free(void)
 {
-  nextstr = stringblob;
+  if (ub->temp_used > ub->temp_high)
+    ub->temp_high = ub->temp_used;
+  ub->temp_used = 0;
+  ub->temp.size = STRING_CHUNK;
+  ub->temp_chunk = &ub->temp;
+  ub->nextstr = ub->temp.data;
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_string_stats(struct ubasic_string_stats *s)
+{
+  s->temp_high = ub->temp_high;
+  s->temp_chunks = ub->temp_chunks + 1;
+  s->heap_size = ub->heap_size;
+  s->heap_used = ub->heap_used;
+}
+/*---------------------------------------------------------------------------*/
+/* The string heap. Free blocks are chained through their first bytes */
+
+static uint8_t string_class(unsigned int len)
+{
+  uint8_t c = 0;
+
+  while((16U << c) < len + 1 + STRING_HDR)
+    c++;
+  return c;
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t *string_alloc(unsigned int len)
+{
+  uint8_t c = string_class(len);
+  struct string_slab *s;
+  unsigned int size = 16U << c;
+  unsigned int i;
+  uint8_t *b;
+
+  if (ub->string_free[c] == NULL) {
+    i = size > STRING_SLAB ? size : STRING_SLAB;
+    s = malloc(sizeof(struct string_slab) - STRING_SLAB + i);
+    if (s == NULL)
+      ubasic_error(outofmemory);
+    s->next = ub->slabs;
+    ub->slabs = s;
+    ub->heap_size += i;
+    for (; i >= size; i -= size) {
+      b = s->data + i - size;
+      memcpy(b, &ub->string_free[c], sizeof(uint8_t *));
+      ub->string_free[c] = b;
+    }
+  }
+  b = ub->string_free[c];
+  memcpy(&ub->string_free[c], b, sizeof(uint8_t *));
+  ub->heap_used += size;
+  *b = c;
+  return b + 1;
+}
+/*---------------------------------------------------------------------------*/
+static void string_release(uint8_t *p)
+{
+  uint8_t c;
+
+  if (p == nullstr)
+    return;
+  c = *--p;
+  ub->heap_used -= 16U << c;
+  memcpy(p, &ub->string_free[c], sizeof(uint8_t *));
+  ub->string_free[c] = p;
+}
+/*---------------------------------------------------------------------------*/
+/* A string value held with its length */
+static void string_set(struct typevalue *v, uint8_t *p)
+{
+  v->type = TYPE_STRING;
+  v->d.p = p;
+  v->s = p + STRING_HDR;
+  v->len = string_len(p);
+}
+/*---------------------------------------------------------------------------*/
+/* Where n first appears in h, or -1 */
+static int string_find(uint8_t const *h, unsigned int hl,
+                       uint8_t const *n, unsigned int nl)
+{
+  unsigned int i = 0;
+  uint8_t const *p;
+
+  if (nl > hl)
+    return -1;
+  if (nl == 0)
+    return 0;
+  hl -= nl - 1;		/* Where a match could start */
+#ifdef VEC
+  {
+    /* Only where the first and last bytes both match is worth a look */
+    vec_t first = vec_splat(n[0]);
+    vec_t last = vec_splat(n[nl - 1]);
+    uint32_t m;
+
+    for (; i + VEC <= hl; i += VEC) {
+      m = vec_eq(vec_load(h + i), first) &
+          vec_eq(vec_load(h + i + nl - 1), last);
+      while(m) {
+        unsigned int b = __builtin_ctz(m);
+        if (memcmp(h + i + b, n, nl) == 0)
+          return i + b;
+        m &= m - 1;
+      }
+    }
+  }
+#endif
+  while(i < hl) {
+    p = memchr(h + i, n[0], hl - i);
+    if (p == NULL)
+      break;
+    i = p - h;
+    if (memcmp(p, n, nl) == 0)
+      return i;
+    i++;
+  }
+  return -1;
 }
 /*---------------------------------------------------------------------------*/
+/* -1, 0 or 1 as a sorts before, the same as or after b */
+static int string_compare(struct typevalue *a, struct typevalue *b)
+{
+  unsigned int n = a->len < b->len ? a->len : b->len;
+  unsigned int i = 0;
+  int r;
+
+#ifdef VEC
+  for (; i + VEC <= n; i += VEC) {
+    uint32_t m = vec_eq(vec_load(a->s + i), vec_load(b->s + i));
+    if (m != (uint32_t)((1ULL << VEC) - 1)) {
+      i += __builtin_ctz(~m);
+      return a->s[i] < b->s[i] ? -1 : 1;
+    }
+  }
+#endif
+  r = memcmp(a->s + i, b->s + i, n - i);
+  if (r)
+    return r < 0 ? -1 : 1;
+  if (a->len != b->len)
+    return a->len < b->len ? -1 : 1;
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* Substrings are left where they are in the original, only storing one in
+   a variable copies it */
 static void string_cut(struct typevalue *o, struct typevalue *t, value_t l, value_t n)
 {
-  uint8_t *p = t->d.p;
-  int f = *p;
+  int f = t->len;
   /* Strings start at 1 ... */
   
-  if (l > f)	/* Nothing to cut */
-    o->d.p = string_temp(0);
+  o->type = TYPE_STRING;
+  o->d.p = NULL;
+  o->s = t->s;
+  if (l < 1)
+    l = 1;
+  if (l > f || n <= 0)	/* Nothing to cut */
+    o->len = 0;
   else {
     f -= l - 1;
     if (f < n)
       n = f;
-    o->d.p = string_temp(n);
-    memcpy(o->d.p+1, p + l, n);
+    o->s += l - 1;
+    o->len = n;
   }
-  o->type = TYPE_STRING;
 }  
 /*---------------------------------------------------------------------------*/
 static void string_cut_r(struct typevalue *o, struct typevalue *t, value_t r)
 {
-  int f = *t->d.p;
+  int f = t->len;
   f -= r;
-  if (f <= 0) {
-    o->d.p = string_temp(0);
-    o->type = TYPE_STRING;
-  } else
-    string_cut(o, t, f + 1, r);
+  /* Nothing left if it is all cut off */
+  string_cut(o, t, f <= 0 ? t->len + 1 : f + 1, r);
 }
 /*---------------------------------------------------------------------------*/
 static value_t string_val(struct typevalue *t)
 {
-  uint8_t *p = t->d.p;
-  uint8_t l = *p++;
+  uint8_t const *p = t->s;
+  unsigned int l = t->len;
   uint8_t neg = 0;
   value_t n = 0;
+  /* A part of a longer string may be empty, so look only within len */
+  if (l == 0)
+    ubasic_error(badtype);
   if (*p == '-') {
     neg = 1;
     p++;
@@ -340,16 +849,64 @@ static void funcexpr(struct typevalue *t, const char *f)
 /*---------------------------------------------------------------------------*/
 static int parse_subscripts(struct typevalue *v)
 {
+    int n = 0;
+
     accept_tok(TOKENIZER_LEFTPAREN);
-    expr(v);
-    if (accept_either(TOKENIZER_COMMA, TOKENIZER_RIGHTPAREN) == TOKENIZER_COMMA) {
-      expr(++v);
-      accept_tok(TOKENIZER_RIGHTPAREN);
-      return 2;
+    do {
+      if (n == MAX_SUBSCRIPT)
+        ubasic_error(badsubscript);
+      expr(v + n++);
+    } while(accept_either(TOKENIZER_COMMA, TOKENIZER_RIGHTPAREN) == TOKENIZER_COMMA);
+    return n;
+}
+
+/*---------------------------------------------------------------------------*/
+static void resolve_variables(void)
+{
+  var_t var;
+
+  /* Every variable in the token stream is already a valid slot number so
+     the only question left is whether it might be an array. Any DIM of it
+     would have to subscript it */
+  for (var = 0; var < MAX_ARRAY; var++)
+    ub->var_plain[var] = ub->arrays[var] == NULL;
+  while(!tokenizer_finished()) {
+    if (current_token == TOKENIZER_INTVAR) {
+      var = tokenizer_variable_num();
+      tokenizer_next();
+      if (current_token == TOKENIZER_LEFTPAREN && var < MAX_ARRAY)
+        ub->var_plain[var] = 0;
+      continue;
     }
-    return 1;
+    tokenizer_next();
+  }
+  tokenizer_goto(ub->program_ptr);
+}
+/*---------------------------------------------------------------------------*/
+/* Integer variables without subscripts. Those known to be plain need none
+   of the checking ubasic_find_variable() does */
+static value_t var_get(var_t var)
+{
+  struct typevalue v;
+
+  if (var >= MAX_ARRAY || ub->var_plain[var])
+    return ub->variables[var];
+  ubasic_get_variable(var, &v, 0, NULL);
+  return v.d.i;
 }
+/*---------------------------------------------------------------------------*/
+static void var_set(var_t var, value_t n)
+{
+  struct typevalue v;
 
+  if (var >= MAX_ARRAY || ub->var_plain[var]) {
+    ub->variables[var] = n;
+    return;
+  }
+  v.type = TYPE_INTEGER;
+  v.d.i = n;
+  ubasic_set_variable(var, &v, 0, NULL);
+}
 /*---------------------------------------------------------------------------*/
 static void varfactor(struct typevalue *v)
 {
@@ -357,7 +914,15 @@ static void varfactor(struct typevalue *v)
   struct typevalue s[MAX_SUBSCRIPT];
   int n = 0;
   /* Sinclair style A$(2 TO 5) would also need to be parsed here if added */
-  accept_either(TOKENIZER_INTVAR, TOKENIZER_STRINGVAR);
+  if (current_token == TOKENIZER_INTVAR) {
+    tokenizer_next();
+    if (current_token != TOKENIZER_LEFTPAREN) {
+      v->type = TYPE_INTEGER;
+      v->d.i = var_get(var);
+      return;
+    }
+  } else
+    accept_tok(TOKENIZER_STRINGVAR);
   if (current_token == TOKENIZER_LEFTPAREN)
     n = parse_subscripts(s);
   ubasic_get_variable(var, v, n, s);
@@ -367,16 +932,17 @@ static void varfactor(struct typevalue *v)
 static void factor(struct typevalue *v)
 {
   uint8_t t = current_token;
-  int len;
   struct typevalue arg[3];
+  uint8_t *p;
 
   DEBUG_PRINTF("factor: token %d\n", current_token);
   switch(t) {
   case TOKENIZER_STRING:
-    v->type = TYPE_STRING;
-    len = tokenizer_string_len();
-    v->d.p = string_temp(len);
-    memcpy(v->d.p + 1, tokenizer_string(), len);
+    /* Used where it is in the program, string values are never written */
+    p = (uint8_t *)tokenizer_string_view();
+    if (p == NULL)
+      ubasic_error("String too long");
+    string_set(v, p);
     DEBUG_PRINTF("factor: string %p\n", v->d.p);
     accept_tok(TOKENIZER_STRING);
     break;
@@ -401,7 +967,7 @@ static void factor(struct typevalue *v)
       switch(t) {
       case TOKENIZER_PEEK:
         funcexpr(arg,"I");
-        v->d.i = peek_function(arg[0].d.i);
+        v->d.i = ub->peek_function(arg[0].d.i);
         break;
       case TOKENIZER_ABS:
         funcexpr(arg,"I");
@@ -421,12 +987,12 @@ static void factor(struct typevalue *v)
         break;
       case TOKENIZER_LEN:
         funcexpr(arg,"S");
-        v->d.i = *arg[0].d.p;
+        v->d.i = arg[0].len;
         break;
       case TOKENIZER_CODE:
         funcexpr(arg,"S");
-        if (*arg[0].d.p)
-          v->d.i = arg[0].d.p[1];
+        if (arg[0].len)
+          v->d.i = arg[0].s[0];
         else
           v->d.i = 0;
         break;
@@ -434,6 +1000,18 @@ static void factor(struct typevalue *v)
         funcexpr(arg,"S");
         v->d.i = string_val(&arg[0]);
         break;
+      case TOKENIZER_INSTR:
+        /* Position of the third in the second from the first on, or 0 */
+        funcexpr(arg,"ISS");
+        v->d.i = arg[0].d.i < 1 ? 1 : arg[0].d.i;
+        if ((unsigned int)v->d.i > arg[1].len + 1)
+          v->d.i = 0;
+        else {
+          int f = string_find(arg[1].s + v->d.i - 1, arg[1].len - v->d.i + 1,
+                              arg[2].s, arg[2].len);
+          v->d.i = f < 0 ? 0 : v->d.i + f;
+        }
+        break;
       default:
         syntax_error();
       }
@@ -456,9 +1034,9 @@ static void factor(struct typevalue *v)
         break;
       case TOKENIZER_CHRSTR:
         funcexpr(arg, "I");
-        v->d.p = string_temp(2);
-        v->d.p[1] = arg[0].d.i;
-        v->type = TYPE_STRING;
+        p = string_temp(1);
+        p[STRING_HDR] = arg[0].d.i;
+        string_set(v, p);
         break;
       default:
         syntax_error();
@@ -530,11 +1108,10 @@ static void mathexpr(struct typevalue *v)
         v->d.i += t2.d.i;
       else {
         uint8_t *p;
-        uint8_t l = *v->d.p;
-        p = string_temp(l + *t2.d.p);
-        memcpy(p + 1, v->d.p + 1, l);
-        memcpy(p + l + 1, t2.d.p + 1, *t2.d.p);
-        v->d.p = p;
+        p = string_temp(v->len + t2.len);
+        memcpy(p + STRING_HDR, v->s, v->len);
+        memcpy(p + STRING_HDR + v->len, t2.s, t2.len);
+        string_set(v, p);
       }
       break;
     case TOKENIZER_MINUS:
@@ -595,16 +1172,7 @@ static void relation(struct typevalue *r1)
         break;
       }
     } else {
-      int n =*r1->d.p;
-      if (*r2.d.p < n)
-        n = *r2.d.p;
-      n = memcmp(r1->d.p + 1, r2.d.p + 1, n);
-      if (n == 0) {
-        if (*r1->d.p > *r2.d.p)
-          n = 1;
-        else if (*r1->d.p < *r2.d.p)
-          n = -1;
-      }
+      int n = string_compare(r1, &r2);
       switch(op) {
         case TOKENIZER_LT:
           n = (n == -1);
@@ -627,193 +1195,754 @@ static void relation(struct typevalue *r1)
       }
       r1->d.i = n;
     }
+    r1->type = TYPE_INTEGER;
     op = current_token;
   }
-  r1->type = TYPE_INTEGER;
 }
 /*---------------------------------------------------------------------------*/
-static void expr(struct typevalue *r1)
-{
-  struct typevalue r2;
-  int op;
+/* Compiled expressions. The first time an expression is evaluated it is
+   compiled, if it is purely integer, into a postfix string of tokens kept
+   by its token position. Later evaluations run that instead of parsing it
+   again. Anything involving strings is left to the parser.
+
+   The code uses the operator tokens as they are, TOKENIZER_NUMBER and
+   TOKENIZER_INTVAR with a 16bit value push a constant or a variable and
+   TOKENIZER_LEFTPAREN with a variable and a count pushes an array element
+   indexed by the values on the stack */
+
+#define MAX_EXPR_CODE	64
+
+static UBASIC_TLS uint8_t expr_code[MAX_EXPR_CODE];
+static UBASIC_TLS uint8_t expr_code_len;
+static UBASIC_TLS uint8_t expr_depth;
+
+static uint8_t cexpr(void);
 
-  relation(r1);
-  op = current_token;
-  DEBUG_PRINTF("logicrelation: token %d\n", op);
-  /* FIXME: unclear the while is correct here. It's not correct in most
-     BASIC to write  A > B > C, rather relations should be two part linked
-     with logic */
-  while(op == TOKENIZER_AND ||
-       op == TOKENIZER_OR) {
-    tokenizer_next();
-    relation(&r2);
-    /* No type checks needed on relations */
-    DEBUG_PRINTF("logicrelation: %d %d %d\n", r1->d.i, op, r2.d.i);
-    switch(op) {
-      case TOKENIZER_AND:
-        r1->d.i = r1->d.i & r2.d.i;
-        break;
-      case TOKENIZER_OR:
-        r1->d.i = r1->d.i | r2.d.i;
-        break;
-    }
-    op = current_token;
-  }
-  r1->type = TYPE_INTEGER;
-}
 /*---------------------------------------------------------------------------*/
-static value_t intexpr(void)
+static uint8_t cemit(uint8_t c)
 {
-  struct typevalue t;
-  expr(&t);
-  typecheck_int(&t);
-  return t.d.i;
+  if (expr_code_len == MAX_EXPR_CODE)
+    return 0;
+  expr_code[expr_code_len++] = c;
+  return 1;
 }
 /*---------------------------------------------------------------------------*/
-static uint8_t *stringexpr(void)
+static uint8_t cemit16(uint8_t c, unsigned int v)
 {
-  struct typevalue t;
-  expr(&t);
-  typecheck_string(&t);
-  return t.d.p;
+  return cemit(c) && cemit(v) && cemit(v >> 8);
 }
 /*---------------------------------------------------------------------------*/
-static void index_free(void) {
-  if(line_index_head != NULL) {
-    line_index_current = line_index_head;
-    do {
-      DEBUG_PRINTF("Freeing index for line %p.\n", (void *)line_index_current);
-      line_index_head = line_index_current;
-      line_index_current = line_index_current->next;
-      free(line_index_head);
-    } while (line_index_current != NULL);
-    line_index_head = NULL;
-  }
+static uint8_t cpush(void)
+{
+  return ++expr_depth <= MAX_EXPR_STACK;
 }
 /*---------------------------------------------------------------------------*/
-static char const *index_find(int linenum) {
-  #if DEBUG
-  int step = 0;
-  #endif
-  struct line_index *lidx;
-  lidx = line_index_head;
-
-
-  while(lidx != NULL && lidx->line_number != linenum) {
-    lidx = lidx->next;
+/* The compiler follows the same grammar as factor() to expr() below so that
+   it stops on exactly the same token. It returns 0 for anything it does not
+   handle, including syntax errors which the parser will then report */
+static uint8_t cfactor(void)
+{
+  uint8_t t = current_token;
+  var_t var;
+  uint8_t n = 1;
 
-    #if DEBUG
-    if(lidx != NULL) {
-      DEBUG_PRINTF("index_find: Step %3d. Found index for line %d: %p.\n",
-                   step, lidx->line_number,
-                   lidx->program_text_position);
+  switch(t) {
+  case TOKENIZER_NUMBER:
+    if (!cemit16(t, tokenizer_num()))
+      return 0;
+    tokenizer_next();
+    return cpush();
+  case TOKENIZER_LEFTPAREN:
+    tokenizer_next();
+    if (!cexpr() || current_token != TOKENIZER_RIGHTPAREN)
+      return 0;
+    tokenizer_next();
+    return 1;
+  case TOKENIZER_INTVAR:
+    var = tokenizer_variable_num();
+    tokenizer_next();
+    if (current_token != TOKENIZER_LEFTPAREN)
+      return cemit16(t, var) && cpush();
+    tokenizer_next();
+    if (!cexpr())
+      return 0;
+    if (current_token == TOKENIZER_COMMA) {
+      tokenizer_next();
+      if (!cexpr())
+        return 0;
+      n = 2;
     }
-    step++;
-    #endif
-  }
-  if(lidx != NULL && lidx->line_number == linenum) {
-    DEBUG_PRINTF("index_find: Returning index for line %d.\n", linenum);
-    return lidx->program_text_position;
+    if (current_token != TOKENIZER_RIGHTPAREN)
+      return 0;
+    tokenizer_next();
+    expr_depth -= n;
+    return cemit16(TOKENIZER_LEFTPAREN, var) && cemit(n) && cpush();
+  case TOKENIZER_PEEK:
+  case TOKENIZER_ABS:
+  case TOKENIZER_INT:
+  case TOKENIZER_SGN:
+    tokenizer_next();
+    if (current_token != TOKENIZER_LEFTPAREN)
+      return 0;
+    tokenizer_next();
+    if (!cexpr() || current_token != TOKENIZER_RIGHTPAREN)
+      return 0;
+    tokenizer_next();
+    /* INT() is a no-op on integers */
+    return t == TOKENIZER_INT || cemit(t);
   }
-  DEBUG_PRINTF("index_find: Returning NULL.\n");
-  return NULL;
+  return 0;
 }
 /*---------------------------------------------------------------------------*/
-static void index_add(int linenum, char const* sourcepos) {
-  struct line_index *new_lidx;
+static uint8_t cterm(void)
+{
+  uint8_t op;
 
-  if(line_index_head != NULL && index_find(linenum)) {
-    return;
+  if (!cfactor())
+    return 0;
+  op = current_token;
+  while(op == TOKENIZER_ASTR ||
+       op == TOKENIZER_SLASH ||
+       op == TOKENIZER_MOD) {
+    tokenizer_next();
+    if (!cfactor() || !cemit(op))
+      return 0;
+    expr_depth--;
+    op = current_token;
   }
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t cmathexpr(void)
+{
+  uint8_t op;
 
-  new_lidx = malloc(sizeof(struct line_index));
-  new_lidx->line_number = linenum;
-  new_lidx->program_text_position = sourcepos;
-  new_lidx->next = NULL;
+  if (!cterm())
+    return 0;
+  op = current_token;
+  while(op == TOKENIZER_PLUS ||
+       op == TOKENIZER_MINUS ||
+       op == TOKENIZER_BAND ||
+       op == TOKENIZER_BOR) {
+    tokenizer_next();
+    if (!cterm() || !cemit(op))
+      return 0;
+    expr_depth--;
+    op = current_token;
+  }
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t crelation(void)
+{
+  uint8_t op;
 
-  if(line_index_head != NULL) {
-    line_index_current->next = new_lidx;
-    line_index_current = line_index_current->next;
-  } else {
-    line_index_current = new_lidx;
-    line_index_head = line_index_current;
+  if (!cmathexpr())
+    return 0;
+  op = current_token;
+  while(op == TOKENIZER_LT ||
+       op == TOKENIZER_GT ||
+       op == TOKENIZER_EQ ||
+       op == TOKENIZER_NE ||
+       op == TOKENIZER_LE ||
+       op == TOKENIZER_GE) {
+    tokenizer_next();
+    if (!cmathexpr() || !cemit(op))
+      return 0;
+    expr_depth--;
+    op = current_token;
   }
-  DEBUG_PRINTF("index_add: Adding index for line %d: %p.\n", linenum,
-               sourcepos);
+  return 1;
 }
 /*---------------------------------------------------------------------------*/
-static void
-jump_linenum_slow(int linenum)
+static uint8_t cexpr(void)
 {
-  tokenizer_init(program_ptr);
-  while(tokenizer_num() != linenum) {
-    do {
-      do {
-        tokenizer_next();
-      } while(current_token != TOKENIZER_CR &&
-          current_token != TOKENIZER_ENDOFINPUT);
-      if(current_token == TOKENIZER_CR) {
-        tokenizer_next();
+  uint8_t op;
+
+  if (!crelation())
+    return 0;
+  op = current_token;
+  while(op == TOKENIZER_AND ||
+       op == TOKENIZER_OR) {
+    tokenizer_next();
+    /* On integers the logic operators are the bitwise ones */
+    if (!crelation() || !cemit(op == TOKENIZER_AND ? TOKENIZER_BAND : TOKENIZER_BOR))
+      return 0;
+    expr_depth--;
+    op = current_token;
+  }
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+static void expr_compile(struct expr_cache *ec)
+{
+  char const *start = tokenizer_pos();
+
+  ec->pos = start;
+  ec->code = NULL;
+  ub->expr_cache_used++;
+
+  expr_code_len = 0;
+  expr_depth = 0;
+  if (cexpr() && cemit(TOKENIZER_ENDOFINPUT)) {
+    ec->end = tokenizer_pos();
+    /* If we are short of memory just keep parsing it */
+    ec->code = malloc(expr_code_len);
+    if (ec->code)
+      memcpy(ec->code, expr_code, expr_code_len);
+  }
+  DEBUG_PRINTF("expr_compile: %p %s\n", start, ec->code ? "compiled" : "parsed");
+  tokenizer_goto(start);
+}
+/*---------------------------------------------------------------------------*/
+/* With UBASIC_VM the whole program is compiled as well, see vm_compile(),
+   and run through the same loop. The statement ops are in tokenizer.h */
+
+/* Run the statement or evaluate the integer expression at a token offset.
+   Used for the parts of a program that are not compiled, by run_code(),
+   the JIT and the C that ubc writes */
+void ubasic_statement(unsigned int pos)
+{
+  tokenizer_goto(ub->program_ptr + pos);
+  statement();
+  if (!statement_end())
+    syntax_error();
+}
+/*---------------------------------------------------------------------------*/
+value_t ubasic_expr(unsigned int pos, uint8_t term)
+{
+  struct typevalue v;
+
+  tokenizer_goto(ub->program_ptr + pos);
+  string_temp_free();
+  expr(&v);
+  typecheck_int(&v);
+  if (current_token != term)
+    syntax_error();
+  return v.d.i;
+}
+/*---------------------------------------------------------------------------*/
+#ifdef UBASIC_VM
+uint8_t const *ubasic_code(unsigned int *len)
+{
+  *len = ub->vm_len;
+  return ub->vm_code;
+}
+#endif
+/*---------------------------------------------------------------------------*/
+
+/* gcc can jump straight from op to op through a table of labels rather than
+   going back round a switch each time */
+#if defined(UBASIC_VM) && defined(__GNUC__)
+#define OP(t, name)	op_##name
+#define DISPATCH()	__extension__ ({ goto *ops[*c++]; })
+#else
+#define OP(t, name)	case t
+#define DISPATCH()	continue
+#endif
+
+static value_t run_code(uint8_t const *c)
+{
+  value_t stack[MAX_EXPR_STACK + MAX_CODE_SUBSCRIPT];
+  value_t *sp = stack;
+  struct typevalue v;
+  struct typevalue s[MAX_SUBSCRIPT];
+  value_t r;
+  uint8_t n;
+#ifdef UBASIC_VM
+  struct for_state *fs;
+  int slot;
+#endif
+#if defined(UBASIC_VM) && defined(__GNUC__)
+  __extension__ static const void *const ops[256] = {
+    [0 ... 255] = &&op_bad,
+    [TOKENIZER_ENDOFINPUT] = &&op_return,
+    [TOKENIZER_NUMBER] = &&op_number,
+    [TOKENIZER_INTVAR] = &&op_intvar,
+    [TOKENIZER_LEFTPAREN] = &&op_array,
+    [TOKENIZER_PEEK] = &&op_peek,
+    [TOKENIZER_ABS] = &&op_abs,
+    [TOKENIZER_SGN] = &&op_sgn,
+    [TOKENIZER_ASTR] = &&op_mul,
+    [TOKENIZER_SLASH] = &&op_div,
+    [TOKENIZER_MOD] = &&op_mod,
+    [TOKENIZER_PLUS] = &&op_add,
+    [TOKENIZER_MINUS] = &&op_sub,
+    [TOKENIZER_BAND] = &&op_and,
+    [TOKENIZER_BOR] = &&op_or,
+    [TOKENIZER_LT] = &&op_lt,
+    [TOKENIZER_GT] = &&op_gt,
+    [TOKENIZER_EQ] = &&op_eq,
+    [TOKENIZER_LE] = &&op_le,
+    [TOKENIZER_GE] = &&op_ge,
+    [TOKENIZER_NE] = &&op_ne,
+    [OP_LINE] = &&op_line,
+    [OP_END] = &&op_end,
+    [OP_STMT] = &&op_stmt,
+    [OP_EXPR] = &&op_expr,
+    [OP_STORE] = &&op_store,
+    [OP_ASTORE] = &&op_astore,
+    [OP_JZ] = &&op_jz,
+    [OP_JMP] = &&op_jmp,
+    [OP_GOSUB] = &&op_gosub,
+    [OP_GOTOX] = &&op_gotox,
+    [OP_GOSUBX] = &&op_gosubx,
+    [OP_RETURN] = &&op_ret,
+    [OP_FOR] = &&op_for,
+    [OP_NEXT] = &&op_next,
+    [OP_STOP] = &&op_stop,
+  };
+
+  DISPATCH();
+#else
+  for(;;) switch(*c++) {
+#endif
+  OP(TOKENIZER_ENDOFINPUT, return):
+    return sp[-1];
+  OP(TOKENIZER_NUMBER, number):
+    *sp++ = c[0] | (c[1] << 8);
+    c += 2;
+    DISPATCH();
+  OP(TOKENIZER_INTVAR, intvar):
+    *sp++ = var_get(c[0] | (c[1] << 8));
+    c += 2;
+    DISPATCH();
+  OP(TOKENIZER_LEFTPAREN, array):
+    n = c[2];
+    sp -= n;
+    s[0].type = s[1].type = TYPE_INTEGER;
+    s[0].d.i = sp[0];
+    s[1].d.i = sp[1];
+    ubasic_get_variable(c[0] | (c[1] << 8), &v, n, s);
+    *sp++ = v.d.i;
+    c += 3;
+    DISPATCH();
+  OP(TOKENIZER_PEEK, peek):
+    sp[-1] = ub->peek_function(sp[-1]);
+    DISPATCH();
+  OP(TOKENIZER_ABS, abs):
+    if (sp[-1] < 0)
+      sp[-1] = -sp[-1];
+    DISPATCH();
+  OP(TOKENIZER_SGN, sgn):
+    if (sp[-1] > 1) sp[-1] = 1;
+    if (sp[-1] < 0) sp[-1] = -1;
+    DISPATCH();
+  OP(TOKENIZER_ASTR, mul):
+    r = *--sp;
+    sp[-1] *= r;
+    DISPATCH();
+  OP(TOKENIZER_SLASH, div):
+    r = *--sp;
+    if (r == 0)
+      ubasic_error(divzero);
+    sp[-1] /= r;
+    DISPATCH();
+  OP(TOKENIZER_MOD, mod):
+    r = *--sp;
+    if (r == 0)
+      ubasic_error(divzero);
+    sp[-1] %= r;
+    DISPATCH();
+  OP(TOKENIZER_PLUS, add):
+    r = *--sp;
+    sp[-1] += r;
+    DISPATCH();
+  OP(TOKENIZER_MINUS, sub):
+    r = *--sp;
+    sp[-1] -= r;
+    DISPATCH();
+  OP(TOKENIZER_BAND, and):
+    r = *--sp;
+    sp[-1] &= r;
+    DISPATCH();
+  OP(TOKENIZER_BOR, or):
+    r = *--sp;
+    sp[-1] |= r;
+    DISPATCH();
+  OP(TOKENIZER_LT, lt):
+    r = *--sp;
+    sp[-1] = sp[-1] < r;
+    DISPATCH();
+  OP(TOKENIZER_GT, gt):
+    r = *--sp;
+    sp[-1] = sp[-1] > r;
+    DISPATCH();
+  OP(TOKENIZER_EQ, eq):
+    r = *--sp;
+    sp[-1] = sp[-1] == r;
+    DISPATCH();
+  OP(TOKENIZER_LE, le):
+    r = *--sp;
+    sp[-1] = sp[-1] <= r;
+    DISPATCH();
+  OP(TOKENIZER_GE, ge):
+    r = *--sp;
+    sp[-1] = sp[-1] >= r;
+    DISPATCH();
+  OP(TOKENIZER_NE, ne):
+    r = *--sp;
+    sp[-1] = sp[-1] != r;
+    DISPATCH();
+#ifdef UBASIC_VM
+  OP(OP_LINE, line):
+    ub->line_num = c[0] | (c[1] << 8);
+    /* STOP lets the rest of its line run, as the parser does */
+    if (ub->ended)
+      return 0;
+    /* Line starts and NEXT are where a budgeted run can stop, each counts
+       as one statement */
+    if (--ub->budget < 0) {
+      ub->vm_pc = c - 1;
+      return 0;
+    }
+    c += 2;
+    DISPATCH();
+  OP(OP_END, end):
+    ub->ended = 1;
+    return 0;
+  OP(OP_STMT, stmt):
+    c += 2;
+    ubasic_statement(c[-2] | (c[-1] << 8));
+    if (ub->waiting) {
+      ub->vm_pc = c - 3;
+      return 0;
+    }
+    DISPATCH();
+  OP(OP_EXPR, expr):
+    *sp++ = ubasic_expr(c[0] | (c[1] << 8), c[2]);
+    c += 3;
+    DISPATCH();
+  OP(OP_STORE, store):
+    var_set(c[0] | (c[1] << 8), *--sp);
+    c += 2;
+    DISPATCH();
+  OP(OP_ASTORE, astore):
+    v.type = TYPE_INTEGER;
+    v.d.i = *--sp;
+    n = c[2];
+    sp -= n;
+    s[0].type = s[1].type = TYPE_INTEGER;
+    s[0].d.i = sp[0];
+    s[1].d.i = sp[1];
+    ubasic_set_variable(c[0] | (c[1] << 8), &v, n, s);
+    c += 3;
+    DISPATCH();
+  OP(OP_JZ, jz):
+    if (*--sp == 0)
+      c = ub->vm_code + (c[0] | (c[1] << 8));
+    else
+      c += 2;
+    DISPATCH();
+  OP(OP_GOSUB, gosub):
+    if (ub->gosub_stack_ptr == MAX_GOSUB_STACK_DEPTH)
+      ubasic_error("Return without gosub");
+    ub->gosub_stack[ub->gosub_stack_ptr++] = (char const *)c + 2;
+    /* Fall through */
+  OP(OP_JMP, jmp):
+    c = ub->vm_code + (c[0] | (c[1] << 8));
+    DISPATCH();
+  OP(OP_GOSUBX, gosubx):
+    if (ub->gosub_stack_ptr == MAX_GOSUB_STACK_DEPTH)
+      ubasic_error("Return without gosub");
+    ub->gosub_stack[ub->gosub_stack_ptr++] = (char const *)c;
+    /* Fall through */
+  OP(OP_GOTOX, gotox):
+    slot = index_slot(*--sp);
+    if (slot < 0)
+      ubasic_error(badline);
+    c = ub->vm_code + ub->vm_lines[slot];
+    DISPATCH();
+  OP(OP_RETURN, ret):
+    if (ub->gosub_stack_ptr > 0)
+      c = (uint8_t const *)ub->gosub_stack[--ub->gosub_stack_ptr];
+    DISPATCH();
+  OP(OP_FOR, for):
+    if (ub->for_stack_ptr < MAX_FOR_STACK_DEPTH) {
+      fs = &ub->for_stack[ub->for_stack_ptr++];
+      fs->resume_token = (char const *)c + 2;
+      fs->for_variable = c[0] | (c[1] << 8);
+      /* The OP_STORE before has already checked the variable */
+      fs->var = &ub->variables[fs->for_variable];
+      fs->to = sp[-2];
+      fs->step = sp[-1];
+    }
+    sp -= 2;
+    c += 2;
+    DISPATCH();
+  OP(OP_NEXT, next):
+    if (ub->for_stack_ptr == 0 ||
+        ub->for_stack[ub->for_stack_ptr - 1].for_variable != (c[0] | (c[1] << 8)))
+      ubasic_error("Mismatched NEXT");
+    fs = &ub->for_stack[ub->for_stack_ptr - 1];
+    r = *fs->var += fs->step;
+    if ((fs->step >= 0 && r <= fs->to) ||
+        (fs->step < 0 && r >= fs->to)) {
+      c = (uint8_t const *)fs->resume_token;
+      /* This one has been run, stop if it was the last */
+      if (!ub->one_line && --ub->budget <= 0) {
+        ub->vm_pc = c;
+        return 0;
       }
-    } while(current_token != TOKENIZER_NUMBER);
-    DEBUG_PRINTF("jump_linenum_slow: Found line %d\n", tokenizer_num());
+    } else {
+      ub->for_stack_ptr--;
+      c += 2;
+    }
+    DISPATCH();
+  OP(OP_STOP, stop):
+    ub->ended = 1;
+    DISPATCH();
+#endif
+#if defined(UBASIC_VM) && defined(__GNUC__)
+  op_bad:
+#else
+  default:
+#endif
+    syntax_error();
+#if !defined(UBASIC_VM) || !defined(__GNUC__)
+  }
+#endif
+  return 0;
+}
+#undef OP
+#undef DISPATCH
+/*---------------------------------------------------------------------------*/
+static struct expr_cache *expr_find(char const *pos)
+{
+  struct expr_cache *old = ub->expr_cache;
+  unsigned int old_size = ub->expr_cache_size;
+  unsigned int mask, i;
+
+  /* Keep the open addressed table at most three quarters full */
+  if (4 * (ub->expr_cache_used + 1) > 3 * ub->expr_cache_size) {
+    ub->expr_cache_size = old_size ? old_size * 2 : 32;
+    ub->expr_cache = calloc(ub->expr_cache_size, sizeof(struct expr_cache));
+    if (ub->expr_cache == NULL)
+      ubasic_error(outofmemory);
+    mask = ub->expr_cache_size - 1;
+    while(old_size--) {
+      if (old[old_size].pos == NULL)
+        continue;
+      i = (old[old_size].pos - ub->program_ptr) & mask;
+      while(ub->expr_cache[i].pos != NULL)
+        i = (i + 1) & mask;
+      ub->expr_cache[i] = old[old_size];
+    }
+    free(old);
   }
+  mask = ub->expr_cache_size - 1;
+  i = (pos - ub->program_ptr) & mask;
+  while(ub->expr_cache[i].pos != NULL && ub->expr_cache[i].pos != pos)
+    i = (i + 1) & mask;
+  return &ub->expr_cache[i];
+}
+/*---------------------------------------------------------------------------*/
+static void expr_cache_free(void)
+{
+  while(ub->expr_cache_size--)
+    free(ub->expr_cache[ub->expr_cache_size].code);
+  free(ub->expr_cache);
+  ub->expr_cache = NULL;
+  ub->expr_cache_size = 0;
+  ub->expr_cache_used = 0;
+}
+/*---------------------------------------------------------------------------*/
+static void expr(struct typevalue *r1)
+{
+  struct typevalue r2;
+  int op;
+  struct expr_cache *ec = expr_find(tokenizer_pos());
+
+  if (ec->pos == NULL)
+    expr_compile(ec);
+  if (ec->code) {
+    r1->type = TYPE_INTEGER;
+    r1->d.i = run_code(ec->code);
+    tokenizer_goto(ec->end);
+    return;
+  }
+
+  relation(r1);
+  op = current_token;
+  DEBUG_PRINTF("logicrelation: token %d\n", op);
+  /* FIXME: unclear the while is correct here. It's not correct in most
+     BASIC to write  A > B > C, rather relations should be two part linked
+     with logic */
+  while(op == TOKENIZER_AND ||
+       op == TOKENIZER_OR) {
+    tokenizer_next();
+    relation(&r2);
+    typecheck_int(r1);
+    typecheck_int(&r2);
+    DEBUG_PRINTF("logicrelation: %d %d %d\n", r1->d.i, op, r2.d.i);
+    switch(op) {
+      case TOKENIZER_AND:
+        r1->d.i = r1->d.i & r2.d.i;
+        break;
+      case TOKENIZER_OR:
+        r1->d.i = r1->d.i | r2.d.i;
+        break;
+    }
+    op = current_token;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static value_t intexpr(void)
+{
+  struct typevalue t;
+  expr(&t);
+  typecheck_int(&t);
+  return t.d.i;
+}
+/*---------------------------------------------------------------------------*/
+static void stringexpr(struct typevalue *t)
+{
+  expr(t);
+  typecheck_string(t);
+}
+/*---------------------------------------------------------------------------*/
+static void index_free(void) {
+  free(ub->line_index);
+  ub->line_index = NULL;
+  ub->line_index_len = 0;
+}
+/*---------------------------------------------------------------------------*/
+static void index_add(line_t linenum, char const *pos) {
+  struct line_index *lidx;
+  unsigned int i;
+
+  /* Called by the tokenizer for each line start as the program is loaded.
+     Programs are normally in order already so the insertion sort costs a
+     compare per line, and being stable the first of any duplicate numbers
+     wins */
+  if ((ub->line_index_len & 63) == 0) {
+    lidx = realloc(ub->line_index, (ub->line_index_len + 64) * sizeof(struct line_index));
+    if (lidx == NULL)
+      ubasic_error(outofmemory);
+    ub->line_index = lidx;
+  }
+  i = ub->line_index_len++;
+  while(i && ub->line_index[i - 1].line_number > linenum) {
+    ub->line_index[i] = ub->line_index[i - 1];
+    i--;
+  }
+  ub->line_index[i].line_number = linenum;
+  ub->line_index[i].program_text_position = pos;
+  DEBUG_PRINTF("index_add: Adding index for line %d: %p.\n", linenum, pos);
+}
+/*---------------------------------------------------------------------------*/
+static int index_slot(int linenum) {
+  unsigned int low = 0;
+  unsigned int high = ub->line_index_len;
+  unsigned int mid;
+
+  /* Find the first entry that is not below linenum */
+  while(low < high) {
+    mid = (low + high) / 2;
+    if (ub->line_index[mid].line_number < (line_t)linenum)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  if(low < ub->line_index_len && ub->line_index[low].line_number == (line_t)linenum)
+    return low;
+  return -1;
+}
+/*---------------------------------------------------------------------------*/
+static char const *index_find(int linenum) {
+  int slot = index_slot(linenum);
+
+  if(slot >= 0) {
+    DEBUG_PRINTF("index_find: Returning index for line %d.\n", linenum);
+    return ub->line_index[slot].program_text_position;
+  }
+  DEBUG_PRINTF("index_find: Returning NULL.\n");
+  return NULL;
 }
 /*---------------------------------------------------------------------------*/
 static void
 jump_linenum(int linenum)
 {
   char const* pos = index_find(linenum);
-  if(pos != NULL) {
-    DEBUG_PRINTF("jump_linenum: Going to line %d.\n", linenum);
-    tokenizer_goto(pos);
-  } else {
-    /* We'll try to find a yet-unindexed line to jump to. */
-    DEBUG_PRINTF("jump_linenum: Calling jump_linenum_slow %d.\n", linenum);
-    jump_linenum_slow(linenum);
+  if(pos == NULL)
+    ubasic_error(badline);
+  DEBUG_PRINTF("jump_linenum: Going to line %d.\n", linenum);
+  tokenizer_goto(pos);
+}
+/*---------------------------------------------------------------------------*/
+static void resolve_jumps(void)
+{
+  char const *pos;
+  char const *target;
+
+  /* A GO TO or GO SUB of a constant line gets the token position of that
+     line patched in at load time, so running it needs no lookup */
+  while(!tokenizer_finished()) {
+    if (current_token != TOKENIZER_GO) {
+      tokenizer_next();
+      continue;
+    }
+    tokenizer_next();
+    if (current_token != TOKENIZER_TO && current_token != TOKENIZER_SUB)
+      continue;
+    tokenizer_next();
+    if (current_token != TOKENIZER_NUMBER)
+      continue;
+    pos = tokenizer_pos();
+    target = index_find(tokenizer_num());
+    tokenizer_next();
+    if (target != NULL && statement_end())
+      tokenizer_resolve(pos, target);
   }
+  tokenizer_goto(ub->program_ptr);
 }
 /*---------------------------------------------------------------------------*/
 static void go_statement(void)
 {
-  int linenum;
+  int linenum = 0;
+  char const *pos = NULL;
   uint8_t t;
 
   t = accept_either(TOKENIZER_TO, TOKENIZER_SUB);
-  if (t == TOKENIZER_TO) {
+  if (current_token == TOKENIZER_LINEREF) {
+    /* Resolved at load time and already known to end the statement */
+    pos = tokenizer_target();
+    tokenizer_next();
+  } else {
     linenum = intexpr();
     DEBUG_PRINTF("go_statement: go to %d.\n", linenum);
     if (!statement_end())
       syntax_error();
-    DEBUG_PRINTF("go_statement: jumping.\n");
-    jump_linenum(linenum);
-    return;
   }
-  linenum = intexpr();
-  if (!statement_end())
-    syntax_error();
 
-  if(gosub_stack_ptr < MAX_GOSUB_STACK_DEPTH) {
-    gosub_stack[gosub_stack_ptr] = tokenizer_pos();
-    gosub_stack_ptr++;
-    jump_linenum(linenum);
-  } else {
-    DEBUG_PRINTF("gosub_statement: gosub stack exhausted\n");
-    ubasic_error("Return without gosub");
+  if (t == TOKENIZER_SUB) {
+    if(ub->gosub_stack_ptr < MAX_GOSUB_STACK_DEPTH) {
+      ub->gosub_stack[ub->gosub_stack_ptr] = tokenizer_pos();
+      ub->gosub_stack_ptr++;
+    } else {
+      DEBUG_PRINTF("gosub_statement: gosub stack exhausted\n");
+      ubasic_error("Return without gosub");
+    }
   }
+  DEBUG_PRINTF("go_statement: jumping.\n");
+  if (pos != NULL)
+    tokenizer_goto(pos);
+  else
+    jump_linenum(linenum);
 }
 /*---------------------------------------------------------------------------*/
 
 #include "lib/textmode/textmode.h"
 
-static int chpos = 0, Y=0;
+static int Y=0;
 extern uint8_t text_color;
 char cursor;
 
 void begin_input(void)
 {
   cursor = 1;
-  vram_attr[Y][chpos] = cursor;
+  if (ub->output == NULL)
+    vram_attr[Y][ub->chpos] = cursor;
 }
 
 void end_input(void)
@@ -823,10 +1952,24 @@ void end_input(void)
 
 void charout(char c, void *unused)
 {
+  int chpos = ub->chpos;
+
   if (c == '\t') {
     do {
       charout(' ', NULL);
-    } while(chpos%8);
+    } while(ub->chpos%8);
+    return;
+  }
+
+  if (ub->output) {
+    if (c == '\r' || c == '\n')
+      ub->chpos = 0;
+    else if (c == 8 || c == 127) {
+      if (chpos)
+        ub->chpos--;
+    } else
+      ub->chpos++;
+    ub->output(c, ub->output_ctx);
     return;
   }
 
@@ -852,22 +1995,24 @@ void charout(char c, void *unused)
   vram_attr[Y][chpos] = cursor;
   vram_attr[Y][chpos-1] = 0;
   vram_attr[Y][chpos+1] = 0;
+  ub->chpos = chpos;
 }
 
 static void charreset(void)
 {
-  chpos = 0;
+  ub->chpos = 0;
 }
 
 static void chartab(value_t v)
 {
-  while(chpos < v)
+  while(ub->chpos < v)
     charout(' ', NULL);
 }
 
-static void charoutstr(uint8_t *p)
+static void charoutstr(struct typevalue *t)
 {
-  int len =*p++;
+  uint8_t const *p = t->s;
+  unsigned int len = t->len;
   while(len--)
     charout(*p++, NULL);
 }
@@ -887,6 +2032,7 @@ static void intout(value_t v)
 
 static void print_statement(void)
 {
+  struct typevalue v;
   uint8_t nonl;
   uint8_t t;
   uint8_t nv = 0;
@@ -903,7 +2049,8 @@ static void print_statement(void)
         nv = 1;
         continue;
       } else if(TOKENIZER_STRINGEXP(t)) {
-        charoutstr(stringexpr());
+        stringexpr(&v);
+        charoutstr(&v);
         nv = 1;
         continue;
       } else if(TOKENIZER_NUMEXP(t)) {
@@ -923,98 +2070,636 @@ static void print_statement(void)
         accept_tok(TOKENIZER_COMMA);
         x = intexpr();
         if (move_cursor(x,y))
-          chpos = x;
+          ub->chpos = x;
         continue;
       }
     }
-    nv = 0;
-    if(t == TOKENIZER_COMMA) {
-      charout('\t', NULL);
-      nonl = 1;
+    nv = 0;
+    if(t == TOKENIZER_COMMA) {
+      charout('\t', NULL);
+      nonl = 1;
+      tokenizer_next();
+    } else if(t == TOKENIZER_SEMICOLON) {
+      nonl = 1;
+      tokenizer_next();
+    } else if (!statement_end()) {
+      syntax_error();
+      break;
+    }
+  } while(!statement_end());
+  if (!nonl)
+    charout('\n', 0);
+  DEBUG_PRINTF("End of print\n");
+}
+
+/*---------------------------------------------------------------------------*/
+static uint8_t if_statement(void)
+{
+  struct typevalue r;
+
+  expr(&r);
+  DEBUG_PRINTF("if_statement: relation %d\n", r.d.i);
+  /* FIXME allow THEN number */
+  accept_tok(TOKENIZER_THEN);
+  /* The THEN part is run as the statements that follow */
+  if(r.d.i)
+    return 2;
+  tokenizer_newline();
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+/* A$ = A$ + ... adds the rest to the end of A$, in place if its block has
+   room. + is the only string operator so this is the same as building the
+   whole value, but a string grown a piece at a time is no longer copied
+   over and over */
+static uint8_t string_append(var_t var)
+{
+  char const *pos = tokenizer_pos();
+  struct typevalue v;
+  uint8_t **s;
+  uint8_t *p;
+  unsigned int l, n;
+
+  if (current_token != TOKENIZER_STRINGVAR || tokenizer_variable_num() != var)
+    return 0;
+  tokenizer_next();
+  if (current_token != TOKENIZER_PLUS) {
+    tokenizer_goto(pos);
+    return 0;
+  }
+  tokenizer_next();
+  s = ubasic_find_variable(var, &v, 0, NULL);
+  expr(&v);
+  typecheck_string(&v);
+  l = string_len(*s);
+  n = v.len;
+  if (l + n > STRING_MAX)
+    ubasic_error("String too long");
+  if (n == 0)
+    return 1;
+  if (*s != nullstr && (16U << (*s)[-1]) >= l + n + 1 + STRING_HDR) {
+    /* What is added may be part of A$ but not past its old end */
+    memmove(*s + STRING_HDR + l, v.s, n);
+    string_header(*s, l + n);
+  } else {
+    p = string_alloc(l + n);
+    memcpy(p + STRING_HDR, *s + STRING_HDR, l);
+    memcpy(p + STRING_HDR + l, v.s, n);
+    string_header(p, l + n);
+    string_release(*s);
+    *s = p;
+  }
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+static void let_statement(void)
+{
+  var_t var;
+  struct typevalue v;
+  struct typevalue s[MAX_SUBSCRIPT];
+  int n = 0;
+
+  var = tokenizer_variable_num();
+  accept_either(TOKENIZER_INTVAR, TOKENIZER_STRINGVAR);
+  if (current_token == TOKENIZER_LEFTPAREN)
+    n = parse_subscripts(s);
+
+  accept_tok(TOKENIZER_EQ);
+  if (n == 0 && (var & STRINGFLAG) && string_append(var))
+    return;
+  expr(&v);
+  DEBUG_PRINTF("let_statement: assign %d to %d\n", var, v.d.i);
+  if (n == 0 && v.type == TYPE_INTEGER && !(var & STRINGFLAG))
+    var_set(var, v.d.i);
+  else
+    ubasic_set_variable(var, &v, n, s);
+}
+/*---------------------------------------------------------------------------*/
+static void return_statement(void)
+{
+  if(ub->gosub_stack_ptr > 0) {
+    ub->gosub_stack_ptr--;
+    tokenizer_goto(ub->gosub_stack[ub->gosub_stack_ptr]);
+  } else {
+    DEBUG_PRINTF("return_statement: non-matching return\n");
+  }
+}
+/*---------------------------------------------------------------------------*/
+#ifdef UBASIC_JIT
+/* Native code for hot loops. Once NEXT has gone round the same loop often
+   enough its body is compiled to x86-64 from the code cexpr() produces.
+   Statements that do not change the flow of control but are not integer
+   LET or IF are called back into the parser one at a time. Anything else,
+   such as GO TO or an inner FOR, leaves the whole loop to the interpreter.
+
+   The top of the expression stack is kept in eax and the rest at rbx. The
+   loop's for_state is in r12 and variables[] in r13 */
+
+#define JIT_THRESHOLD	16
+#define MAX_JIT_FIXUPS	8
+
+static uint8_t jit_enabled = 1;
+
+static UBASIC_TLS uint8_t jit_buf[8192];
+static UBASIC_TLS unsigned int jit_len;
+static UBASIC_TLS uint8_t jit_failed;
+static UBASIC_TLS uint8_t jit_depth;
+static UBASIC_TLS unsigned int jit_fixup[MAX_JIT_FIXUPS];	/* IFs to patch at the CR */
+static UBASIC_TLS uint8_t jit_fixups;
+
+#define JIT(s)		jit_code(s, sizeof(s) - 1)
+#define JIT_PUSH	"\x89\x03\x48\x83\xC3\x04"	/* mov [rbx],eax; add rbx,4 */
+#define JIT_POP(r)	"\x48\x83\xEB\x04\x8B" r	/* sub rbx,4; mov r,[rbx] */
+#define JIT_EAX		"\x03"
+#define JIT_ECX		"\x0B"
+#define JIT_EDX		"\x13"
+
+static void jit_code(const char *p, unsigned int n)
+{
+  if (jit_len + n > sizeof(jit_buf)) {
+    jit_failed = 1;
+    return;
+  }
+  memcpy(jit_buf + jit_len, p, n);
+  jit_len += n;
+}
+/*---------------------------------------------------------------------------*/
+static void jit_32(uint32_t v)
+{
+  uint8_t b[4];
+  b[0] = v;
+  b[1] = v >> 8;
+  b[2] = v >> 16;
+  b[3] = v >> 24;
+  jit_code((char *)b, 4);
+}
+/*---------------------------------------------------------------------------*/
+static void jit_64(uint64_t v)
+{
+  jit_32(v);
+  jit_32(v >> 32);
+}
+/*---------------------------------------------------------------------------*/
+static void jit_call(uintptr_t fn)
+{
+  JIT("\x48\xB8");		/* movabs rax, fn */
+  jit_64(fn);
+  JIT("\xFF\xD0");		/* call rax */
+}
+/*---------------------------------------------------------------------------*/
+static void jit_divzero(void)
+{
+  ubasic_error(divzero);
+}
+/*---------------------------------------------------------------------------*/
+/* Array elements and any variable with checks to make go through these */
+static int jit_aget(int var, int n, int s1, int s2)
+{
+  struct typevalue v;
+  struct typevalue s[MAX_SUBSCRIPT];
+  s[0].type = s[1].type = TYPE_INTEGER;
+  s[0].d.i = s1;
+  s[1].d.i = s2;
+  ubasic_get_variable(var, &v, n, s);
+  return v.d.i;
+}
+/*---------------------------------------------------------------------------*/
+static void jit_aset(int var, int n, int s1, int s2, int value)
+{
+  struct typevalue v;
+  struct typevalue s[MAX_SUBSCRIPT];
+  s[0].type = s[1].type = TYPE_INTEGER;
+  s[0].d.i = s1;
+  s[1].d.i = s2;
+  v.type = TYPE_INTEGER;
+  v.d.i = value;
+  ubasic_set_variable(var, &v, n, s);
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t jit_scalar(var_t var)
+{
+  return var >= MAX_ARRAY || ub->var_plain[var];
+}
+/*---------------------------------------------------------------------------*/
+static void jit_value(void)
+{
+  if (jit_depth++)
+    JIT(JIT_PUSH);
+}
+/*---------------------------------------------------------------------------*/
+static void jit_helper_args(var_t var, uint8_t n)
+{
+  JIT("\xBF");			/* mov edi, var */
+  jit_32(var);
+  JIT("\xBE");			/* mov esi, n */
+  jit_32(n);
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t jit_cexpr(void)
+{
+  uint8_t *c = expr_code;
+  uint8_t *e;
+  uint8_t op;
+  var_t var;
+
+  expr_code_len = 0;
+  expr_depth = 0;
+  if (!cexpr())
+    return 0;
+  e = expr_code + expr_code_len;
+  while(c < e) {
+    op = *c++;
+    switch(op) {
+    case TOKENIZER_NUMBER:
+      jit_value();
+      JIT("\xB8");		/* mov eax, n */
+      jit_32((value_t)(c[0] | (c[1] << 8)));
+      c += 2;
+      continue;
+    case TOKENIZER_INTVAR:
+      var = c[0] | (c[1] << 8);
+      c += 2;
+      jit_value();
+      if (jit_scalar(var)) {
+        JIT("\x41\x0F\xBF\x85");	/* movsx eax, word [r13+var] */
+        jit_32(var * sizeof(value_t));
+      } else {
+        jit_helper_args(var, 0);
+        jit_call((uintptr_t)jit_aget);
+        JIT("\x98");		/* cwde */
+      }
+      continue;
+    case TOKENIZER_LEFTPAREN:
+      var = c[0] | (c[1] << 8);
+      if (c[2] == 2) {
+        JIT("\x89\xC1");		/* mov ecx, eax */
+        JIT(JIT_POP(JIT_EDX));
+      } else
+        JIT("\x89\xC2");		/* mov edx, eax */
+      jit_helper_args(var, c[2]);
+      jit_call((uintptr_t)jit_aget);
+      JIT("\x98");
+      jit_depth -= c[2] - 1;
+      c += 3;
+      continue;
+    case TOKENIZER_PEEK:
+      JIT("\x89\xC7\x48\xB8");	/* mov edi, eax; movabs rax, &peek_function */
+      jit_64((uintptr_t)&ub->peek_function);
+      JIT("\x48\x8B\x00\xFF\xD0\x98");	/* mov rax, [rax]; call rax; cwde */
+      continue;
+    case TOKENIZER_ABS:
+      JIT("\x85\xC0\x79\x03\xF7\xD8\x98");	/* if (eax < 0) eax = -eax */
+      continue;
+    case TOKENIZER_SGN:
+      JIT("\x83\xF8\x01\x7E\x05\xB8\x01\x00\x00\x00"	/* if (eax > 1) eax = 1 */
+          "\x85\xC0\x79\x05\xB8\xFF\xFF\xFF\xFF");	/* if (eax < 0) eax = -1 */
+      continue;
+    }
+    /* Binary operators: left into eax, right into ecx */
+    JIT("\x89\xC1");
+    JIT(JIT_POP(JIT_EAX));
+    jit_depth--;
+    switch(op) {
+    case TOKENIZER_ASTR:
+      JIT("\x0F\xAF\xC1\x98");	/* imul eax, ecx; cwde */
+      break;
+    case TOKENIZER_SLASH:
+    case TOKENIZER_MOD:
+      JIT("\x85\xC9\x75\x0C");	/* test ecx, ecx; jnz over the call */
+      jit_call((uintptr_t)jit_divzero);
+      JIT("\x99\xF7\xF9");	/* cdq; idiv ecx */
+      if (op == TOKENIZER_MOD)
+        JIT("\x89\xD0");		/* mov eax, edx */
+      JIT("\x98");
+      break;
+    case TOKENIZER_PLUS:
+      JIT("\x01\xC8\x98");
+      break;
+    case TOKENIZER_MINUS:
+      JIT("\x29\xC8\x98");
+      break;
+    case TOKENIZER_BAND:
+      JIT("\x21\xC8");
+      break;
+    case TOKENIZER_BOR:
+      JIT("\x09\xC8");
+      break;
+    default:
+      JIT("\x39\xC8\x0F");	/* cmp eax, ecx; setcc al; movzx eax, al */
+      switch(op) {
+      case TOKENIZER_LT:
+        JIT("\x9C");
+        break;
+      case TOKENIZER_GT:
+        JIT("\x9F");
+        break;
+      case TOKENIZER_EQ:
+        JIT("\x94");
+        break;
+      case TOKENIZER_LE:
+        JIT("\x9E");
+        break;
+      case TOKENIZER_GE:
+        JIT("\x9D");
+        break;
+      case TOKENIZER_NE:
+        JIT("\x95");
+        break;
+      }
+      JIT("\xC0\x0F\xB6\xC0");
+    }
+  }
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t jit_let(void)
+{
+  var_t var = tokenizer_variable_num();
+  uint8_t n = 0;
+
+  jit_depth = 0;
+  tokenizer_next();
+  if (current_token == TOKENIZER_LEFTPAREN) {
+    do {
+      tokenizer_next();
+      if (n == MAX_CODE_SUBSCRIPT || !jit_cexpr())
+        return 0;
+      n++;
+    } while(current_token == TOKENIZER_COMMA);
+    if (current_token != TOKENIZER_RIGHTPAREN)
+      return 0;
+    tokenizer_next();
+  }
+  if (current_token != TOKENIZER_EQ)
+    return 0;
+  tokenizer_next();
+  if (!jit_cexpr() || !statement_end())
+    return 0;
+  if (n == 0 && jit_scalar(var)) {
+    JIT("\x66\x41\x89\x85");	/* mov word [r13+var], ax */
+    jit_32(var * sizeof(value_t));
+    return 1;
+  }
+  JIT("\x41\x89\xC0");		/* mov r8d, eax */
+  if (n == 2)
+    JIT(JIT_POP(JIT_ECX));
+  if (n)
+    JIT(JIT_POP(JIT_EDX));
+  jit_helper_args(var, n);
+  jit_call((uintptr_t)jit_aset);
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+/* Returns 0 if the loop cannot be compiled, 2 if a statement follows
+   directly as after THEN */
+static uint8_t jit_statement(void)
+{
+  char const *start = tokenizer_pos();
+  unsigned int len = jit_len;
+  uint8_t t = current_token;
+
+  if (t == TOKENIZER_LET) {
+    tokenizer_next();
+    t = current_token;
+  }
+  switch(t) {
+  case TOKENIZER_INTVAR:
+    if (jit_let())
+      return 1;
+    /* Leave anything more complicated to the parser */
+    jit_len = len;
+    tokenizer_goto(start);
+    break;
+  case TOKENIZER_IF:
+    tokenizer_next();
+    jit_depth = 0;
+    if (!jit_cexpr() || current_token != TOKENIZER_THEN ||
+        jit_fixups == MAX_JIT_FIXUPS)
+      return 0;
+    tokenizer_next();
+    JIT("\x85\xC0\x0F\x84");	/* test eax, eax; jz end of line */
+    jit_fixup[jit_fixups++] = jit_len;
+    jit_32(0);
+    return 2;
+  case TOKENIZER_REM:
+    tokenizer_newline();
+    return 1;
+  case TOKENIZER_STRINGVAR:
+  case TOKENIZER_PRINT:
+  case TOKENIZER_QUESTION:
+  case TOKENIZER_POKE:
+  case TOKENIZER_DATA:
+  case TOKENIZER_RANDOMIZE:
+  case TOKENIZER_OPTION:
+  case TOKENIZER_RESTORE:
+  case TOKENIZER_CLS:
+    break;
+  default:
+    /* Including INPUT, which may have to stop the program part way */
+    return 0;
+  }
+  JIT("\xBF");			/* mov edi, pos */
+  jit_32(start - ub->program_ptr);
+  jit_call((uintptr_t)ubasic_statement);
+  tokenizer_goto(start);
+  while(!statement_end() && !tokenizer_finished())
+    tokenizer_next();
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+static void jit_patch(void)
+{
+  unsigned int i;
+  uint32_t rel;
+
+  while(jit_fixups) {
+    i = jit_fixup[--jit_fixups];
+    rel = jit_len - (i + 4);
+    memcpy(jit_buf + i, &rel, 4);
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void *jit_compile(char const *resume, char const *next, var_t var,
+                         size_t *size)
+{
+  unsigned int top;
+  uint32_t statements = 1;	/* The NEXT */
+  uint8_t r;
+  void *p;
+
+  jit_len = 0;
+  jit_failed = 0;
+  jit_fixups = 0;
+  if (!jit_scalar(var))
+    return NULL;
+  /* push rbx; push r12; push r13; mov rbx, rdi; mov r12, rsi; mov r13, rdx */
+  JIT("\x53\x41\x54\x41\x55\x48\x89\xFB\x49\x89\xF4\x49\x89\xD5");
+  top = jit_len;
+
+  tokenizer_goto(resume);
+  for(;;) {
+    if (current_token == TOKENIZER_COLON) {
+      tokenizer_next();
+      continue;
+    }
+    if (current_token == TOKENIZER_CR) {
+      jit_patch();
       tokenizer_next();
-    } else if(t == TOKENIZER_SEMICOLON) {
-      nonl = 1;
+      if (current_token != TOKENIZER_NUMBER)
+        return NULL;
+      JIT("\x48\xB8");		/* movabs rax, &line_num */
+      jit_64((uintptr_t)&ub->line_num);
+      JIT("\x66\xC7\x00");	/* mov word [rax], line */
+      jit_code((char *)&(line_t){ tokenizer_num() }, 2);
       tokenizer_next();
-    } else if (!statement_end()) {
-      syntax_error();
+      continue;
+    }
+    if (current_token == TOKENIZER_NEXT) {
+      tokenizer_next();
+      if (tokenizer_pos() != next)
+        return NULL;
       break;
     }
-  } while(!statement_end());
-  if (!nonl)
-    charout('\n', 0);
-  DEBUG_PRINTF("End of print\n");
+    r = jit_statement();
+    if (r == 0 || (r == 1 && !statement_end()))
+      return NULL;
+    statements++;
+  }
+  /* An IF on the line of the NEXT would skip it when false */
+  if (jit_fixups)
+    return NULL;
+
+  /* NEXT: add the step, then loop while not past the limit */
+  JIT("\x41\x0F\xBF\x85");	/* movsx eax, word [r13+var] */
+  jit_32(var * sizeof(value_t));
+  JIT("\x41\x0F\xBF\x4C\x24");	/* movsx ecx, word [r12+step] */
+  jit_code((char *)&(uint8_t){ offsetof(struct for_state, step) }, 1);
+  JIT("\x01\xC8\x98\x66\x41\x89\x85");	/* add eax, ecx; cwde; store */
+  jit_32(var * sizeof(value_t));
+  JIT("\x41\x0F\xBF\x54\x24");	/* movsx edx, word [r12+to] */
+  jit_code((char *)&(uint8_t){ offsetof(struct for_state, to) }, 1);
+  JIT("\x85\xC9\x78\x06");	/* test ecx, ecx; js down */
+  JIT("\x39\xD0\x7F\x21\xEB\x04");	/* cmp eax, edx; jg done; jmp more */
+  JIT("\x39\xD0\x7C\x1B");	/* down: cmp eax, edx; jl done */
+  /* more: charge the budget for the time round, loop while any is left */
+  JIT("\x48\xB8");		/* movabs rax, &budget */
+  jit_64((uintptr_t)&ub->budget);
+  JIT("\x48\x81\x28");		/* sub qword [rax], statements */
+  jit_32(statements);
+  JIT("\x0F\x8F");		/* jg top */
+  jit_32(top - (jit_len + 4));
+  JIT("\x31\xC0\xEB\x05");	/* xor eax, eax; jmp out */
+  JIT("\xB8\x01\x00\x00\x00");	/* done: mov eax, 1 */
+  JIT("\x41\x5D\x41\x5C\x5B\xC3");	/* out: pop r13; pop r12; pop rbx; ret */
+  if (jit_failed)
+    return NULL;
+
+  p = mmap(NULL, jit_len, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  memcpy(p, jit_buf, jit_len);
+  if (mprotect(p, jit_len, PROT_READ | PROT_EXEC)) {
+    munmap(p, jit_len);
+    return NULL;
+  }
+  *size = jit_len;
+  DEBUG_PRINTF("jit_compile: %p %u bytes\n", resume, jit_len);
+  return p;
 }
-
 /*---------------------------------------------------------------------------*/
-static void if_statement(void)
+/* Called by NEXT when it is about to go round again. Returns 1 if the loop
+   has been run to the end natively, 0 if it is to go round in the parser */
+static uint8_t jit_run(struct for_state *fs, char const *next)
 {
-  struct typevalue r;
+  int stack[MAX_EXPR_STACK + MAX_CODE_SUBSCRIPT + 1];
+  char const *pos = tokenizer_pos();
+  struct jit_loop *l;
+  unsigned int i;
+  int r;
 
-  expr(&r);
-  DEBUG_PRINTF("if_statement: relation %d\n", r.d.i);
-  /* FIXME allow THEN number */
-  accept_tok(TOKENIZER_THEN);
-  if(r.d.i) {
-    statementgroup();
-  } else {
-    tokenizer_newline();
+  if (!jit_enabled || ub->budget <= 0)
+    return 0;
+  for (i = 0; i < ub->jit_used; i++)
+    if (ub->jit_loops[i].resume == fs->resume_token && ub->jit_loops[i].next == next)
+      break;
+  if (i == ub->jit_used) {
+    if (ub->jit_used == MAX_JIT_LOOPS)
+      return 0;
+    ub->jit_used++;
+    ub->jit_loops[i].resume = fs->resume_token;
+    ub->jit_loops[i].next = next;
+    ub->jit_loops[i].count = 0;
+    ub->jit_loops[i].code.p = NULL;
+  }
+  l = &ub->jit_loops[i];
+  if (l->code.p == NULL) {
+    /* Only ever try once */
+    if (++l->count != JIT_THRESHOLD)
+      return 0;
+    l->code.p = jit_compile(l->resume, next, fs->for_variable, &l->size);
+    tokenizer_goto(pos);
+    if (l->code.p == NULL)
+      return 0;
   }
+  r = l->code.f(stack, fs, ub->variables);
+  tokenizer_goto(pos);
+  return r;
 }
 /*---------------------------------------------------------------------------*/
-static void let_statement(void)
+static void jit_free(void)
 {
-  var_t var;
-  struct typevalue v;
-  struct typevalue s[MAX_SUBSCRIPT];
-  int n = 0;
-
-  var = tokenizer_variable_num();
-  accept_either(TOKENIZER_INTVAR, TOKENIZER_STRINGVAR);
-  if (current_token == TOKENIZER_LEFTPAREN)
-    n = parse_subscripts(s);
-
-  accept_tok(TOKENIZER_EQ);
-  expr(&v);
-  DEBUG_PRINTF("let_statement: assign %d to %d\n", var, v.d.i);
-  ubasic_set_variable(var, &v, n, s);
+  while(ub->jit_used--)
+    if (ub->jit_loops[ub->jit_used].code.p)
+      munmap(ub->jit_loops[ub->jit_used].code.p, ub->jit_loops[ub->jit_used].size);
+  ub->jit_used = 0;
 }
+#endif
 /*---------------------------------------------------------------------------*/
-static void return_statement(void)
+void ubasic_jit(int enable)
 {
-  if(gosub_stack_ptr > 0) {
-    gosub_stack_ptr--;
-    tokenizer_goto(gosub_stack[gosub_stack_ptr]);
-  } else {
-    DEBUG_PRINTF("return_statement: non-matching return\n");
-  }
+#ifdef UBASIC_JIT
+  jit_enabled = enable;
+#else
+  (void)enable;
+#endif
 }
 /*---------------------------------------------------------------------------*/
 static void next_statement(void)
 {
   int var;
   struct for_state *fs;
-  struct typevalue t;
+  value_t n;
+#ifdef UBASIC_JIT
+  char const *next;
+#endif
 
   /* FIXME: support 'NEXT' on its own, also loop down the stack so if you
      GOTO out of a layer of NEXT the right thing occurs */
   var = tokenizer_variable_num();
+#ifdef UBASIC_JIT
+  next = tokenizer_pos();
+#endif
   accept_tok(TOKENIZER_INTVAR);
   
   /* FIXME: make the for stack just use pointers so it compiles better */
-  fs = &for_stack[for_stack_ptr - 1];
-  if(for_stack_ptr > 0 &&
-     var == fs->for_variable) {
-    ubasic_get_variable(var, &t, 0, NULL);
-    t.d.i += fs->step;
-    ubasic_set_variable(var, &t, 0,NULL);
-    /* NEXT end depends upon sign of STEP */
-    if ((fs->step >= 0 && t.d.i <= fs->to) ||
-        (fs->step < 0 && t.d.i >= fs->to))
-      tokenizer_goto(fs->resume_token);
-    else
-      for_stack_ptr--;
-  } else
+  if(ub->for_stack_ptr == 0 ||
+     var != ub->for_stack[ub->for_stack_ptr - 1].for_variable)
     ubasic_error("Mismatched NEXT");
+  fs = &ub->for_stack[ub->for_stack_ptr - 1];
+  n = *fs->var += fs->step;
+  /* NEXT end depends upon sign of STEP */
+  if ((fs->step >= 0 && n <= fs->to) ||
+      (fs->step < 0 && n >= fs->to)) {
+#ifdef UBASIC_JIT
+    if (jit_run(fs, next)) {
+      ub->for_stack_ptr--;
+      return;
+    }
+#endif
+    tokenizer_resume(fs->resume_token, fs->resume_next);
+  } else
+    ub->for_stack_ptr--;
 }
 /*---------------------------------------------------------------------------*/
 static void for_statement(void)
@@ -1040,9 +2725,12 @@ static void for_statement(void)
     syntax_error();
   /* Save a pointer to the : or CR, when we return to statements it
      will do the right thing */
-  if(for_stack_ptr < MAX_FOR_STACK_DEPTH) {
-    struct for_state *fs = &for_stack[for_stack_ptr];
+  if(ub->for_stack_ptr < MAX_FOR_STACK_DEPTH) {
+    struct for_state *fs = &ub->for_stack[ub->for_stack_ptr];
     fs->resume_token = tokenizer_pos();
+    fs->resume_next = tokenizer_pos_next();
+    /* Known to be a plain variable now it has been set */
+    fs->var = &ub->variables[for_variable];
     fs->for_variable = for_variable;
     fs->to = to;
     fs->step = step;
@@ -1051,7 +2739,7 @@ static void for_statement(void)
                 fs->to,
                 fs->step);
 
-    for_stack_ptr++;
+    ub->for_stack_ptr++;
   } else {
     DEBUG_PRINTF("for_statement: for stack depth exceeded\n");
   }
@@ -1066,12 +2754,12 @@ static void poke_statement(void)
   accept_tok(TOKENIZER_COMMA);
   value = intexpr();
 
-  poke_function(poke_addr, value);
+  ub->poke_function(poke_addr, value);
 }
 /*---------------------------------------------------------------------------*/
 static void stop_statement(void)
 {
-  ended = 1;
+  ub->ended = 1;
 }
 /*---------------------------------------------------------------------------*/
 static void rem_statement(void)
@@ -1125,22 +2813,54 @@ static void option_statement(void)
   r = intexpr();
   if (r < 0 || r > 1)
     ubasic_error("Invalid base");
-  array_base = r;
+  ub->array_base = r;
 }
 
 /*---------------------------------------------------------------------------*/
 
+/* Get a line for INPUT into buf. If the host gives them with ubasic_input()
+   and has not yet, note the variable at pos and return -1 so the program
+   can stop and carry on from there later */
+static int input_line(char *buf, char const *pos)
+{
+  int l;
+
+  if (ub->input_async) {
+    if (!ub->input_ready) {
+      ub->input_resume = pos;
+      ub->waiting = 1;
+      return -1;
+    }
+    ub->input_ready = 0;
+    l = ub->input_len;
+    if (l > 0)
+      memcpy(buf, ub->input_buf, l);
+  } else if ((l = _read(0, buf, INPUT_MAX)) == 0)
+    l = -1;
+  /* FIXME: this works for stdin but not files .. */
+  if (l < 0) {
+    write(2, "EOF\n", 4);
+    exit(1);
+  }
+  return l;
+}
+
 static void input_statement(void)
 {
   struct typevalue r;
   var_t v;
-  char buf[129];
+  char buf[INPUT_MAX + STRING_HDR + 1];
+  char const *pos;
   uint8_t t;
   uint8_t first = 1;
   int l;
   
   t = current_token;
-  if (t == TOKENIZER_STRING) {
+  if (ub->input_resume) {
+    /* Carry on from the variable it stopped at */
+    tokenizer_goto(ub->input_resume);
+    ub->input_resume = NULL;
+  } else if (t == TOKENIZER_STRING) {
     tokenizer_string_func(charout, NULL);
     tokenizer_next();
     t = current_token;
@@ -1159,27 +2879,29 @@ static void input_statement(void)
     if (!first)
       accept_either(TOKENIZER_COMMA, TOKENIZER_SEMICOLON);
     first = 0;
+    pos = tokenizer_pos();
     t = current_token;
     v = tokenizer_variable_num();
     accept_either(TOKENIZER_INTVAR, TOKENIZER_STRINGVAR);
     if (current_token == TOKENIZER_LEFTPAREN)
       n = parse_subscripts(s);
 
-    /* FIXME: this works for stdin but not files .. */
-    if ((l = _read(0, buf + 1, 128)) <= 0) {
-      write(2, "EOF\n", 4);
-      exit(1);
+    if ((l = input_line(buf + STRING_HDR, pos)) < 0) {
+      while(!statement_end() && !tokenizer_finished())
+        tokenizer_next();
+      break;
     }
+    buf[STRING_HDR + l] = 0;
     charreset();		/* Newline input so move to left */
     if (t == TOKENIZER_INTVAR) {
       r.type = TYPE_INTEGER;	/* For now */
-      r.d.i = atoi(buf + 1);	/* FIXME: error checking */
+      r.d.i = atoi(buf + STRING_HDR);	/* FIXME: error checking */
     } else {
       /* Turn a C string into a BASIC one */
       r.type = TYPE_STRING;
-      if (buf[l-1] == '\n')
+      if (l > 0 && buf[STRING_HDR + l - 1] == '\n')
         l--;
-      *((uint8_t *)buf) = l;
+      string_header((uint8_t *)buf, l);
       r.d.p = (uint8_t *)buf;
     }
     ubasic_set_variable(v, &r, n, s);
@@ -1196,11 +2918,11 @@ void restore_statement(void)
   if (linenum) {
     tokenizer_push();
     jump_linenum(linenum);
-    data_position = tokenizer_pos();
+    ub->data_position = tokenizer_pos();
     tokenizer_pop();
   } else
-    data_position = program_ptr;
-  data_seek = 1;
+    ub->data_position = ub->program_ptr;
+  ub->data_seek = 1;
 }
 
 /*---------------------------------------------------------------------------*/
@@ -1215,8 +2937,10 @@ void cls_statement(void)
 void dim_statement(void)
 {
   var_t v = tokenizer_variable_num();
-  value_t s1,s2 = 1;
-  int n = 1;
+  struct typevalue s[MAX_SUBSCRIPT];
+  value_t top[MAX_SUBSCRIPT];
+  struct array **ap;
+  int n, i;
   
   accept_either(TOKENIZER_STRINGVAR, TOKENIZER_INTVAR);
   
@@ -1224,34 +2948,18 @@ void dim_statement(void)
   if ((v & ~STRINGFLAG) > 25)
     ubasic_error("invalid array name");
   
-  accept_tok(TOKENIZER_LEFTPAREN);
-  s1 = intexpr();
-  if (accept_either(TOKENIZER_RIGHTPAREN, TOKENIZER_COMMA) == TOKENIZER_COMMA) {
-    s2 = intexpr();
-    n = 2;
-    accept_tok(TOKENIZER_RIGHTPAREN);
-  }
-
-  if (v & STRINGFLAG) {
-    uint8_t **p;
-    v &= ~STRINGFLAG;
-    if (stringsubs[v] || strings[v] != nullstr)
-      ubasic_error(redimension);
-    stringsubs[v] = n;
-    stringdim[v][0] = s1;
-    stringdim[v][1] = s2;
-    p = calloc(s1 * s2, sizeof(uint8_t *));
-    strings[v] = (uint8_t *)p;
-    for (n = 0; n < s1 * s2; n++)
-      *p++ = nullstr;
-  } else {
-    if (variablesubs[v])
-      ubasic_error(redimension);
-    variablesubs[v] = n;
-    vardim[v][0] = s1;
-    vardim[v][1] = s2;
-    vararrays[v] = calloc(s1 * s2, sizeof(uint8_t *));
+  n = parse_subscripts(s);
+  for (i = 0; i < n; i++) {
+    typecheck_int(&s[i]);
+    top[i] = s[i].d.i;
   }
+  if (v & STRINGFLAG)
+    ap = &ub->string_arrays[v & ~STRINGFLAG];
+  else
+    ap = &ub->arrays[v];
+  if (*ap)
+    ubasic_error(redimension);
+  *ap = array_new(n, top, (v & STRINGFLAG) != 0);
 }	
 /*---------------------------------------------------------------------------*/
 static uint8_t statement(void)
@@ -1271,8 +2979,7 @@ static uint8_t statement(void)
     print_statement();
     break;
   case TOKENIZER_IF:
-    if_statement();
-    break;
+    return if_statement();
   case TOKENIZER_GO:
     go_statement();
     return 0;
@@ -1333,6 +3040,8 @@ static uint8_t statementgroup(void)
   uint8_t n;
   while((n = statement())) {
     DEBUG_PRINTF("next statement %d\n", current_token);
+    if (n == 2)
+      continue;
     t = current_token;
     if (t == TOKENIZER_COLON)
       accept_tok(TOKENIZER_COLON);
@@ -1349,66 +3058,457 @@ void statements(void)
 }
 
 /*---------------------------------------------------------------------------*/
-static void line_statements(void)
+/* Run the next statement of the program. A GO leaves the tokenizer at the
+   start of a line, anything else at the statement after it, which may be
+   part way along one */
+static void statement_step(void)
+{
+  char const *start;
+  uint8_t n;
+
+  if (!ub->mid_line) {
+    ub->line_num = tokenizer_num();
+    DEBUG_PRINTF("----------- Line number %d ---------\n", ub->line_num);
+    accept_tok(TOKENIZER_NUMBER);
+  }
+  ub->budget--;
+  ub->mid_line = 1;
+  start = tokenizer_pos();
+  n = statement();
+  /* An INPUT waiting for a line is run again once it has one */
+  if (ub->waiting) {
+    tokenizer_goto(start);
+    return;
+  }
+  switch(n) {
+  case 0:
+    ub->mid_line = 0;
+    break;
+  case 1:
+    if (current_token == TOKENIZER_COLON)
+      accept_tok(TOKENIZER_COLON);
+    else {
+      accept_tok(TOKENIZER_CR);
+      ub->mid_line = 0;
+    }
+    break;
+  }
+}
+/*---------------------------------------------------------------------------*/
+#ifdef UBASIC_VM
+/* The bytecode engine. The program is compiled once it is loaded into ops
+   for run_code(), so running it no longer walks tokens. Integer LET, IF,
+   GO TO/SUB, RETURN, FOR, NEXT and STOP are compiled, the rest are handed
+   back to statement() one at a time, as are expressions cexpr() cannot
+   manage. Code offsets are 16bit, a program too big for that is left to
+   the parser */
+
+static void vm_emit(uint8_t c)
+{
+  uint8_t *p;
+
+  if (ub->vm_failed)
+    return;
+  if (ub->vm_len == ub->vm_size) {
+    p = NULL;
+    if (ub->vm_size < 0x10000)
+      p = realloc(ub->vm_code, ub->vm_size ? ub->vm_size * 2 : 256);
+    if (p == NULL) {
+      ub->vm_failed = 1;
+      return;
+    }
+    ub->vm_code = p;
+    ub->vm_size = ub->vm_size ? ub->vm_size * 2 : 256;
+  }
+  ub->vm_code[ub->vm_len++] = c;
+}
+/*---------------------------------------------------------------------------*/
+static void vm_emit16(uint8_t c, unsigned int v)
+{
+  vm_emit(c);
+  vm_emit(v);
+  vm_emit(v >> 8);
+}
+/*---------------------------------------------------------------------------*/
+static void vm_emit_pos(uint8_t c, char const *pos)
+{
+  if (pos - ub->program_ptr > 0xFFFF)
+    ub->vm_failed = 1;
+  vm_emit16(c, pos - ub->program_ptr);
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t vm_cexpr(void)
+{
+  char const *start = tokenizer_pos();
+  uint8_t i;
+
+  expr_code_len = 0;
+  expr_depth = 0;
+  if (cexpr()) {
+    for (i = 0; i < expr_code_len; i++)
+      vm_emit(expr_code[i]);
+    return 1;
+  }
+  tokenizer_goto(start);
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static void vm_intexpr(void)
+{
+  char const *start = tokenizer_pos();
+  int depth = 0;
+  uint8_t t;
+
+  if (vm_cexpr())
+    return;
+  /* Leave it to the parser. Find the token it should stop on, which is
+     checked when it runs */
+  for(;;) {
+    t = current_token;
+    if (t == TOKENIZER_ENDOFINPUT)
+      break;
+    if (depth == 0 && (t == TOKENIZER_TO || t == TOKENIZER_STEP ||
+        t == TOKENIZER_THEN || t == TOKENIZER_ERROR || statement_end()))
+      break;
+    if (t == TOKENIZER_LEFTPAREN)
+      depth++;
+    else if (t == TOKENIZER_RIGHTPAREN && depth-- == 0)
+      break;
+    tokenizer_next();
+  }
+  vm_emit_pos(OP_EXPR, start);
+  vm_emit(t);
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t vm_let(void)
+{
+  var_t var = tokenizer_variable_num();
+  uint8_t n = 0;
+
+  tokenizer_next();
+  if (current_token == TOKENIZER_LEFTPAREN) {
+    do {
+      tokenizer_next();
+      if (n == MAX_CODE_SUBSCRIPT || !vm_cexpr())
+        return 0;
+      n++;
+    } while(current_token == TOKENIZER_COMMA);
+    if (current_token != TOKENIZER_RIGHTPAREN)
+      return 0;
+    tokenizer_next();
+  }
+  if (current_token != TOKENIZER_EQ)
+    return 0;
+  tokenizer_next();
+  if (!vm_cexpr() || !statement_end())
+    return 0;
+  if (n) {
+    vm_emit16(OP_ASTORE, var);
+    vm_emit(n);
+  } else
+    vm_emit16(OP_STORE, var);
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+/* Returns 0 if another statement follows directly, as after THEN. Each IF
+   branches to the end of its line, chained through the operands */
+static uint8_t vm_statement(unsigned int *chain)
+{
+  char const *start = tokenizer_pos();
+  unsigned int len = ub->vm_len;
+  char const *target;
+  uint8_t t = current_token;
+  var_t var;
+
+  if (t == TOKENIZER_LET) {
+    tokenizer_next();
+    t = current_token;
+  }
+  switch(t) {
+  case TOKENIZER_INTVAR:
+    if (vm_let())
+      return 1;
+    break;
+  case TOKENIZER_IF:
+    tokenizer_next();
+    vm_intexpr();
+    if (current_token != TOKENIZER_THEN)
+      break;
+    tokenizer_next();
+    vm_emit16(OP_JZ, *chain);
+    *chain = ub->vm_len - 2;
+    return 0;
+  case TOKENIZER_GO:
+    tokenizer_next();
+    t = current_token;
+    if (t != TOKENIZER_TO && t != TOKENIZER_SUB)
+      break;
+    tokenizer_next();
+    if (current_token == TOKENIZER_LINEREF) {
+      /* Resolved at load time and already known to end the statement */
+      target = tokenizer_target();
+      tokenizer_next();
+      tokenizer_push();
+      tokenizer_goto(target);
+      vm_emit16(t == TOKENIZER_TO ? OP_JMP : OP_GOSUB,
+                ub->vm_lines[index_slot(tokenizer_num())]);
+      tokenizer_pop();
+      return 1;
+    }
+    vm_intexpr();
+    if (!statement_end())
+      break;
+    vm_emit(t == TOKENIZER_TO ? OP_GOTOX : OP_GOSUBX);
+    return 1;
+  case TOKENIZER_RETURN:
+    tokenizer_next();
+    vm_emit(OP_RETURN);
+    return 1;
+  case TOKENIZER_FOR:
+    tokenizer_next();
+    if (current_token != TOKENIZER_INTVAR)
+      break;
+    var = tokenizer_variable_num();
+    tokenizer_next();
+    if (current_token != TOKENIZER_EQ)
+      break;
+    tokenizer_next();
+    vm_intexpr();
+    vm_emit16(OP_STORE, var);
+    if (current_token != TOKENIZER_TO)
+      break;
+    tokenizer_next();
+    vm_intexpr();
+    if (current_token == TOKENIZER_STEP) {
+      tokenizer_next();
+      vm_intexpr();
+    } else
+      vm_emit16(TOKENIZER_NUMBER, 1);
+    if (!statement_end())
+      break;
+    vm_emit16(OP_FOR, var);
+    return 1;
+  case TOKENIZER_NEXT:
+    tokenizer_next();
+    if (current_token != TOKENIZER_INTVAR)
+      break;
+    vm_emit16(OP_NEXT, tokenizer_variable_num());
+    tokenizer_next();
+    return 1;
+  case TOKENIZER_STOP:
+    tokenizer_next();
+    vm_emit(OP_STOP);
+    return 1;
+  case TOKENIZER_REM:
+    tokenizer_newline();
+    return 1;
+  }
+  /* Anything else, including errors, is for the parser to run or report */
+  ub->vm_len = len;
+  tokenizer_goto(start);
+  vm_emit_pos(OP_STMT, start);
+  while(!statement_end() && !tokenizer_finished())
+    tokenizer_next();
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+static void vm_line(void)
 {
-  line_num = tokenizer_num();
-  DEBUG_PRINTF("----------- Line number %d ---------\n", line_num);
-  index_add(line_num, tokenizer_pos());
-  accept_tok(TOKENIZER_NUMBER);
-  statements();
-  return;
+  char const *pos = tokenizer_pos();
+  unsigned int chain = 0;
+  unsigned int next;
+  int slot;
+  uint8_t t;
+
+  if (current_token != TOKENIZER_NUMBER) {
+    vm_emit(OP_SYNTAX);
+    tokenizer_newline();
+    tokenizer_next();
+    return;
+  }
+  /* Only the first of a duplicated line number is ever jumped to */
+  slot = index_slot(tokenizer_num());
+  if (ub->line_index[slot].program_text_position == pos)
+    ub->vm_lines[slot] = ub->vm_len;
+  vm_emit16(OP_LINE, tokenizer_num());
+  tokenizer_next();
+
+  do {
+    while(!vm_statement(&chain))
+      ;
+    t = current_token;
+    if (t == TOKENIZER_COLON)
+      tokenizer_next();
+  } while(t == TOKENIZER_COLON);
+  if (t != TOKENIZER_CR)
+    vm_emit(OP_SYNTAX);
+  tokenizer_newline();
+  tokenizer_next();
+
+  while(chain && !ub->vm_failed) {
+    next = ub->vm_code[chain] | (ub->vm_code[chain + 1] << 8);
+    ub->vm_code[chain] = ub->vm_len;
+    ub->vm_code[chain + 1] = ub->vm_len >> 8;
+    chain = next;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void vm_compile(void)
+{
+  uint8_t pass;
+
+  free(ub->vm_code);
+  free(ub->vm_lines);
+  ub->vm_code = NULL;
+  ub->vm_size = 0;
+  ub->vm_lines = calloc(ub->line_index_len + 1, sizeof(uint16_t));
+  ub->vm_failed = ub->vm_lines == NULL;
+
+  /* The first pass finds where each line starts so that the second can
+     fill in the jumps */
+  for (pass = 0; pass < 2 && !ub->vm_failed; pass++) {
+    ub->vm_len = 0;
+    tokenizer_goto(ub->program_ptr);
+    while(!tokenizer_finished())
+      vm_line();
+    vm_emit(OP_END);
+  }
+  tokenizer_goto(ub->program_ptr);
+  if (ub->vm_failed) {
+    DEBUG_PRINTF("vm_compile: using the parser\n");
+    free(ub->vm_code);
+    ub->vm_code = NULL;
+  }
 }
+#endif
 /*---------------------------------------------------------------------------*/
+#ifdef UBASIC_VM
+static void vm_run(void)
+{
+  uint8_t const *c = ub->vm_pc ? ub->vm_pc : ub->vm_code;
 
+  ub->vm_pc = NULL;
+  if (!ub->ended)
+    run_code(c);
+}
+#endif
 /*---------------------------------------------------------------------------*/
-void ubasic_run(void)
+static enum ubasic_status run_status(void)
 {
+  if (ub->waiting)
+    return UBASIC_INPUT;
+  if (ub->mid_line || !ubasic_finished())
+    return UBASIC_YIELD;
+  return UBASIC_DONE;
+}
+/*---------------------------------------------------------------------------*/
+enum ubasic_status ubasic_run(void)
+{
+  ub->budget = LONG_MAX;
+#ifdef UBASIC_VM
+  if (ub->vm_code != NULL) {
+    /* One line at a time like the parser, with a loop on it run through */
+    ub->budget = 1;
+    ub->one_line = 1;
+    vm_run();
+    ub->one_line = 0;
+    return run_status();
+  }
+#endif
   if(tokenizer_finished()) {
     DEBUG_PRINTF("uBASIC program finished\n");
-    return;
+    return UBASIC_DONE;
   }
 
-  line_statements();
+  do
+    statement_step();
+  while(ub->mid_line && !ub->waiting);
+  return run_status();
+}
+/*---------------------------------------------------------------------------*/
+/* Run at most n statements, catching any error. Loops compiled by the JIT
+   count each statement in them every time round */
+enum ubasic_status ubasic_run_budget(long n)
+{
+  jmp_buf caller;
+
+  if (ub->failed)
+    return UBASIC_ERROR;
+  memcpy(caller, exception, sizeof(jmp_buf));
+  if (setjmp(exception)) {
+    memcpy(exception, caller, sizeof(jmp_buf));
+    ub->failed = 1;
+    ub->ended = 1;
+    return UBASIC_ERROR;
+  }
+  ub->budget = n;
+#ifdef UBASIC_VM
+  ub->one_line = 0;
+  if (ub->vm_code != NULL)
+    vm_run();
+  else
+#endif
+  while(ub->budget > 0 && !ub->waiting &&
+        (ub->mid_line || !ubasic_finished()))
+    statement_step();
+  memcpy(exception, caller, sizeof(jmp_buf));
+  return run_status();
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_input_async(int enable)
+{
+  ub->input_async = enable;
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_input(const char *line, int len)
+{
+  if (line == NULL)
+    len = -1;
+  else if (len > (int)sizeof(ub->input_buf))
+    len = sizeof(ub->input_buf);
+  if (len > 0)
+    memcpy(ub->input_buf, line, len);
+  ub->input_len = len;
+  ub->input_ready = 1;
+  ub->waiting = 0;
 }
 /*---------------------------------------------------------------------------*/
 int ubasic_finished(void)
 {
-  return ended || tokenizer_finished();
+  return ub->ended || tokenizer_finished();
 }
 /*---------------------------------------------------------------------------*/
 void *ubasic_find_variable(int varnum, struct typevalue *value,
                                     int nsubs, struct typevalue *subs)
 {
+  struct array *a;
+  unsigned int i;
+
   if (varnum & STRINGFLAG) {
-    uint8_t **ap;
     varnum &= ~STRINGFLAG;
     value->type = TYPE_STRING;
     /* for now A$-Z$ only */
     if (varnum > 25)
       ubasic_error("invalid string");
-    if (stringsubs[varnum] != nsubs)
-      ubasic_error(badsubscript);
-    if (nsubs == 0)
-      return &strings[varnum];
-    ap = (uint8_t **)strings[varnum];
-    range_check(subs, stringdim[varnum][0]);
-    if (nsubs == 1)
-      return &ap[subs->d.i];
-    range_check(subs+1, stringdim[varnum][1]);
-    return &ap[subs->d.i * stringdim[varnum][0] + subs[1].d.i];
-  } else if(varnum >= 0 && varnum <= MAX_VARNUM) {
-    value_t *ap;
+    a = ub->string_arrays[varnum];
+    if (nsubs == 0) {
+      if (a)
+        ubasic_error(badsubscript);
+      return &ub->strings[varnum];
+    }
+    /* array_index() checks a is an array before it is used */
+    i = array_index(a, nsubs, subs);
+    return &a->e.s[i];
+  } else if(varnum >= 0 && varnum < MAX_VARNUM) {
     value->type = TYPE_INTEGER;
-    if ((varnum > 25 && nsubs) || variablesubs[varnum] != nsubs)
-      ubasic_error(badsubscript);
-    if (nsubs == 0)
-      return &variables[varnum];
-    ap = (value_t *)vararrays[varnum];
-    range_check(subs, vardim[varnum][0]);
-    if (nsubs == 1)
-      return &ap[subs->d.i];
-    range_check(subs+1, vardim[varnum][1]);
-    return &ap[subs->d.i * vardim[varnum][0] + subs[1].d.i];
+    a = varnum < MAX_ARRAY ? ub->arrays[varnum] : NULL;
+    if (nsubs == 0) {
+      if (a)
+        ubasic_error(badsubscript);
+      return &ub->variables[varnum];
+    }
+    i = array_index(a, nsubs, subs);
+    return &a->e.i[i];
   } else
     ubasic_error("badv");
   exit(1);	/* To shut up gcc */
@@ -1421,17 +3521,18 @@ void ubasic_get_variable(int varnum, struct typevalue *value,
   if (value->type == TYPE_INTEGER)
     value->d.i = *(value_t *)v;
   else
-    value->d.p  = *(uint8_t **)v;
+    string_set(value, *(uint8_t **)v);
 }
 /*---------------------------------------------------------------------------*/
-/* This helper will change once we try and stamp out malloc but will do for
-   the moment */
-static uint8_t *string_save(uint8_t *p)
+static uint8_t *string_save(uint8_t const *p, unsigned int len)
 {
-  uint8_t *b = malloc(*p + 1);
-  if (b == NULL)
-    ubasic_error(outofmemory);
-  memcpy(b, p, *p + 1);
+  uint8_t *b;
+
+  if (len == 0)
+    return nullstr;
+  b = string_alloc(len);
+  string_header(b, len);
+  memcpy(b + STRING_HDR, p, len);
   return b;
 }
 
@@ -1448,9 +3549,25 @@ void ubasic_set_variable(int varnum, struct typevalue *value,
   
   if (varnum & STRINGFLAG) {
     uint8_t **s = p;
-    if (*s != nullstr)
-      free(*s);
-    *s = string_save(value->d.p);
+    uint8_t const *n = value->s;
+    unsigned int len = value->len;
+    uint8_t *b;
+    /* Called from outside only the length prefixed form need be set */
+    if (value->d.p) {
+      n = value->d.p + STRING_HDR;
+      len = string_len(value->d.p);
+    }
+    if (len > STRING_MAX)
+      ubasic_error("String too long");
+    /* Reuse the block if the new value fits, it may be part of the old */
+    if (*s != nullstr && (16U << (*s)[-1]) >= len + 1 + STRING_HDR) {
+      memmove(*s + STRING_HDR, n, len);
+      string_header(*s, len);
+    } else {
+      b = string_save(n, len);
+      string_release(*s);
+      *s = b;
+    }
   } else {
     *(value_t *)p = value->d.i;
   }
@@ -36,31 +36,97 @@ typedef uint16_t	var_t;
 
 typedef value_t (*peek_func)(value_t);
 typedef void (*poke_func)(value_t, value_t);
+typedef void (*output_func)(char c, void *ctx);
+
+/* Built with UBASIC_THREADS the current instance and the scratch state are
+   per thread, so each thread can run its own instance */
+#ifdef UBASIC_THREADS
+#define UBASIC_TLS	_Thread_local
+#else
+#define UBASIC_TLS
+#endif
 
 enum type {
   TYPE_INTEGER = 'I',
   TYPE_STRING = 'S'
 };
 
+/* A string is held as its length, STRING_HDR bytes little endian, then
+   its bytes. Built with UBASIC_LONG_STRINGS the length takes two bytes
+   rather than one. LEN() and MID$() work in value_t so that bounds it */
+#ifdef UBASIC_LONG_STRINGS
+#define STRING_HDR	2
+#define STRING_MAX	32767
+#else
+#define STRING_HDR	1
+#define STRING_MAX	255
+#endif
+
 struct typevalue {
   enum type type;
   union {
     value_t i;
-    uint8_t *p;
+    uint8_t *p;		/* Length then the string */
   } d;
+  /* Within the interpreter a string is also len bytes at s. One that is
+     part of another (LEFT$ etc) has only that and p is NULL */
+  uint8_t const *s;
+  unsigned int len;
 };
 
 
 void ubasic_init(const char *program);
 void ubasic_init_peek_poke(const char *program, peek_func peek, poke_func poke);
-void ubasic_run(void);
+
+/* What ubasic_run() and ubasic_run_budget() stopped for */
+enum ubasic_status {
+  UBASIC_YIELD,		/* Out of budget, call again to carry on */
+  UBASIC_DONE,
+  UBASIC_ERROR,		/* Already reported, the program cannot go on */
+  UBASIC_INPUT		/* Waiting at an INPUT for ubasic_input() */
+};
+/* Run the next line (all of it, with any loop on it) */
+enum ubasic_status ubasic_run(void);
+/* Run up to n statements, so that many programs can take turns */
+enum ubasic_status ubasic_run_budget(long n);
+/* With async set INPUT stops the program until the host gives it a line
+   (NULL for end of file) rather than reading one */
+void ubasic_input_async(int enable);
+void ubasic_input(const char *line, int len);
 void ubasic_tokenizer_error(void);
+void ubasic_error(const char *err);
 int ubasic_finished(void);
+void ubasic_jit(int enable);
+line_t *ubasic_line(void);
+/* Send PRINT and error output to func rather than the screen */
+void ubasic_output(output_func func, void *ctx);
 
-extern line_t line_num;
+/* Any number of programs can be loaded at once, each in its own instance.
+   All the other calls act on the one last given to ubasic_use(), or on a
+   default instance if none has been */
+struct ubasic;
+struct ubasic *ubasic_new(void);
+void ubasic_use(struct ubasic *u);
+void ubasic_free(struct ubasic *u);
+
+/* How much memory the strings of the current instance have needed */
+struct ubasic_string_stats {
+  unsigned int temp_high;	/* Most temporary space one statement took */
+  unsigned int temp_chunks;	/* Chunks of it allocated to hold that */
+  unsigned int heap_size;	/* Bytes of slabs for variables' strings */
+  unsigned int heap_used;	/* and of those in use */
+};
+void ubasic_string_stats(struct ubasic_string_stats *s);
 
 void ubasic_get_variable(int varnum, struct typevalue *v, int nsubs, struct typevalue *subs);
 void ubasic_set_variable(int varum, struct typevalue *value, int nsubs, struct typevalue *subs);
+void *ubasic_find_variable(int varnum, struct typevalue *value, int nsubs, struct typevalue *subs);
+
+/* Bytecode engine (UBASIC_VM), for ubc and the C it writes */
+uint8_t const *ubasic_code(unsigned int *len);
+/* Run one statement or expression at a token offset, for compiled code */
+void ubasic_statement(unsigned int pos);
+value_t ubasic_expr(unsigned int pos, uint8_t term);
 
 /* Provided by user */
 void clear_display(void);
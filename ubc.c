@@ -0,0 +1,565 @@
+/*
+ * Copyright (c) 2006, Adam Dunkels
+ * All rights reserved.
+ *
+ * Copyright (c) 2015, Alan Cox
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ *	Translate a BASIC program into C. The program is compiled by the
+ *	bytecode engine as it would be to run, and each op is written out as
+ *	C working on a stack of locals the compiler can keep in registers.
+ *	Lines become labels, and computed GO TO, RETURN and NEXT go through a
+ *	switch. Whatever the engine hands back to the parser the generated
+ *	code does too, so the source is carried along in the output and the
+ *	result links against ubasic.c built with UBASIC_VM.
+ *
+ *	ubc program.bas > program.c
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <setjmp.h>
+#include <sys/stat.h>
+#include "ubasic.h"
+#include "tokenizer.h"
+
+extern jmp_buf exception;
+
+static uint8_t const *code;
+static unsigned int code_len;
+static uint8_t *target;		/* Offsets something jumps to */
+static uint8_t dimmed[MAX_ARRAY];
+static uint8_t *used;		/* Scalars accessed directly */
+static int returns, lines;
+
+#define OPERAND(p)	((p)[1] | ((p)[2] << 8))
+
+/*---------------------------------------------------------------------------*/
+static unsigned int op_size(uint8_t op)
+{
+  switch(op) {
+  case TOKENIZER_LEFTPAREN:
+  case OP_ASTORE:
+  case OP_EXPR:
+    return 4;
+  case TOKENIZER_NUMBER:
+  case TOKENIZER_INTVAR:
+  case OP_LINE:
+  case OP_STMT:
+  case OP_STORE:
+  case OP_JZ:
+  case OP_JMP:
+  case OP_GOSUB:
+  case OP_FOR:
+  case OP_NEXT:
+    return 3;
+  }
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+/* Find the labels we need. Line starts are only needed for a computed
+   GO TO/SUB, and then only the first of each line number */
+static void find_targets(void)
+{
+  unsigned int i, j;
+  uint8_t op;
+  int computed = 0;
+
+  target = calloc(code_len + 1, 1);
+  if (target == NULL) {
+    fprintf(stderr, "ubc: out of memory\n");
+    exit(1);
+  }
+  for (i = 0; i < code_len; i += op_size(op)) {
+    op = code[i];
+    switch(op) {
+    case OP_JZ:
+    case OP_JMP:
+      target[OPERAND(code + i)] = 1;
+      break;
+    case OP_GOSUB:
+    case OP_FOR:
+      target[i + 3] = 2;
+      returns++;
+      if (op == OP_GOSUB)
+        target[OPERAND(code + i)] = 1;
+      break;
+    case OP_GOSUBX:
+      target[i + 1] = 2;
+      returns++;
+      /* Fall through */
+    case OP_GOTOX:
+      computed = 1;
+      break;
+    }
+  }
+  if (!computed)
+    return;
+  for (i = 0; i < code_len; i += op_size(code[i])) {
+    if (code[i] != OP_LINE)
+      continue;
+    for (j = 0; j < i; j += op_size(code[j]))
+      if (code[j] == OP_LINE && OPERAND(code + j) == OPERAND(code + i))
+        break;
+    if (j == i) {
+      target[i] |= 4;
+      lines++;
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void find_arrays(void)
+{
+  /* Scalars are used directly unless a DIM may turn them into an array,
+     when going through ubasic.c gives the same error */
+  while(!tokenizer_finished()) {
+    if (current_token == TOKENIZER_DIM) {
+      tokenizer_next();
+      if (current_token == TOKENIZER_INTVAR &&
+          tokenizer_variable_num() < MAX_ARRAY)
+        dimmed[tokenizer_variable_num()] = 1;
+    }
+    tokenizer_next();
+  }
+}
+/*---------------------------------------------------------------------------*/
+static int direct(unsigned int var)
+{
+  return var >= MAX_ARRAY || !dimmed[var];
+}
+/*---------------------------------------------------------------------------*/
+static void write_source(const char *p)
+{
+  printf("static const char program[] =\n  \"");
+  for (; *p; p++) {
+    if (*p == '"' || *p == '\\')
+      printf("\\%c", *p);
+    else if (*p == '\n')
+      printf("\\n\"\n  \"");
+    else if ((uint8_t)*p < ' ' || (uint8_t)*p > '~')
+      printf("\\%03o", (uint8_t)*p);
+    else
+      putchar(*p);
+  }
+  printf("\";\n\n");
+}
+/*---------------------------------------------------------------------------*/
+static void find_variables(void)
+{
+  unsigned int i;
+  uint8_t op;
+
+  used = calloc(65536, 1);
+  if (used == NULL) {
+    fprintf(stderr, "ubc: out of memory\n");
+    exit(1);
+  }
+  for (i = 0; i < code_len; i += op_size(op)) {
+    op = code[i];
+    if ((op == TOKENIZER_INTVAR || op == OP_STORE || op == OP_NEXT) &&
+        direct(OPERAND(code + i)))
+      used[OPERAND(code + i)] = 1;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void write_header(void)
+{
+  unsigned int var;
+
+  printf("#include <stdint.h>\n"
+         "#include <setjmp.h>\n"
+         "#include <unistd.h>\n"
+         "#include \"ubasic.h\"\n\n"
+         "extern jmp_buf exception;\n"
+         "static value_t peek(value_t arg);\n"
+         "static line_t *line_num;\n\n");
+
+  for (var = 0; var < 65536; var++)
+    if (used[var])
+      printf("static value_t *v%u;\n", var);
+
+  printf("\n"
+         "static inline value_t get(int var)\n"
+         "{\n"
+         "  struct typevalue v;\n"
+         "  ubasic_get_variable(var, &v, 0, NULL);\n"
+         "  return v.d.i;\n"
+         "}\n\n"
+         "static inline void set(int var, value_t n)\n"
+         "{\n"
+         "  struct typevalue v;\n"
+         "  v.type = TYPE_INTEGER;\n"
+         "  v.d.i = n;\n"
+         "  ubasic_set_variable(var, &v, 0, NULL);\n"
+         "}\n\n"
+         "static inline value_t aget(int var, int n, value_t s1, value_t s2)\n"
+         "{\n"
+         "  struct typevalue v, s[2];\n"
+         "  s[0].type = s[1].type = TYPE_INTEGER;\n"
+         "  s[0].d.i = s1;\n"
+         "  s[1].d.i = s2;\n"
+         "  ubasic_get_variable(var, &v, n, s);\n"
+         "  return v.d.i;\n"
+         "}\n\n"
+         "static inline void aset(int var, int n, value_t s1, value_t s2, value_t x)\n"
+         "{\n"
+         "  struct typevalue v, s[2];\n"
+         "  s[0].type = s[1].type = TYPE_INTEGER;\n"
+         "  s[0].d.i = s1;\n"
+         "  s[1].d.i = s2;\n"
+         "  v.type = TYPE_INTEGER;\n"
+         "  v.d.i = x;\n"
+         "  ubasic_set_variable(var, &v, n, s);\n"
+         "}\n\n"
+         "static inline value_t divide(value_t a, value_t b, int mod)\n"
+         "{\n"
+         "  if (b == 0)\n"
+         "    ubasic_error(\"Division by zero\");\n"
+         "  return mod ? a %% b : a / b;\n"
+         "}\n\n");
+}
+/*---------------------------------------------------------------------------*/
+static void write_load(unsigned int var, int sp)
+{
+  if (direct(var))
+    printf("s[%d] = *v%u;", sp, var);
+  else
+    printf("s[%d] = get(%u);", sp, var);
+}
+/*---------------------------------------------------------------------------*/
+static void write_store(unsigned int var, int sp)
+{
+  if (direct(var))
+    printf("*v%u = s[%d];", var, sp);
+  else
+    printf("set(%u, s[%d]);", var, sp);
+}
+/*---------------------------------------------------------------------------*/
+static void write_subs(int n, int sp)
+{
+  if (n == 2)
+    printf("s[%d], s[%d]", sp, sp + 1);
+  else
+    printf("s[%d], 0", sp);
+}
+/*---------------------------------------------------------------------------*/
+/* Every op leaves the stack at a depth known here, so it is written as
+   plain locals */
+static void write_op(unsigned int i, int *spp)
+{
+  uint8_t op = code[i];
+  unsigned int v = OPERAND(code + i);
+  uint8_t n = code[i + 3];
+  const char *bin = NULL;
+  int sp = *spp;
+
+  switch(op) {
+  case TOKENIZER_NUMBER:
+    printf("s[%d] = %d;", sp++, (value_t)v);
+    break;
+  case TOKENIZER_INTVAR:
+    write_load(v, sp++);
+    break;
+  case TOKENIZER_LEFTPAREN:
+    sp -= n;
+    printf("s[%d] = aget(%u, %u, ", sp, v, n);
+    write_subs(n, sp);
+    printf(");");
+    sp++;
+    break;
+  case TOKENIZER_PEEK:
+    printf("s[%d] = peek(s[%d]);", sp - 1, sp - 1);
+    break;
+  case TOKENIZER_ABS:
+    printf("if (s[%d] < 0) s[%d] = -s[%d];", sp - 1, sp - 1, sp - 1);
+    break;
+  case TOKENIZER_SGN:
+    printf("if (s[%d] > 1) s[%d] = 1;\n  if (s[%d] < 0) s[%d] = -1;",
+           sp - 1, sp - 1, sp - 1, sp - 1);
+    break;
+  case TOKENIZER_SLASH:
+  case TOKENIZER_MOD:
+    sp--;
+    printf("s[%d] = divide(s[%d], s[%d], %d);", sp - 1, sp - 1, sp,
+           op == TOKENIZER_MOD);
+    break;
+  case TOKENIZER_ASTR: bin = "*"; break;
+  case TOKENIZER_PLUS: bin = "+"; break;
+  case TOKENIZER_MINUS: bin = "-"; break;
+  case TOKENIZER_BAND: bin = "&"; break;
+  case TOKENIZER_BOR: bin = "|"; break;
+  case TOKENIZER_LT: bin = "<"; break;
+  case TOKENIZER_GT: bin = ">"; break;
+  case TOKENIZER_EQ: bin = "=="; break;
+  case TOKENIZER_LE: bin = "<="; break;
+  case TOKENIZER_GE: bin = ">="; break;
+  case TOKENIZER_NE: bin = "!="; break;
+  case OP_LINE:
+    /* STOP lets the rest of its line run, as the parser does */
+    printf("*line_num = %u; if (ended) return;", v);
+    break;
+  case OP_END:
+    printf("return;");
+    break;
+  case OP_STMT:
+    printf("ubasic_statement(%u);", v);
+    break;
+  case OP_EXPR:
+    printf("s[%d] = ubasic_expr(%u, %u);", sp++, v, n);
+    break;
+  case OP_STORE:
+    write_store(v, --sp);
+    break;
+  case OP_ASTORE:
+    sp -= 1 + n;
+    printf("aset(%u, %u, ", v, n);
+    write_subs(n, sp);
+    printf(", s[%d]);", sp + n);
+    break;
+  case OP_JZ:
+    printf("if (!s[%d]) goto L%u;", --sp, v);
+    break;
+  case OP_JMP:
+    printf("goto L%u;", v);
+    break;
+  case OP_GOSUB:
+  case OP_GOSUBX:
+    printf("if (gp == %d) ubasic_error(\"Return without gosub\");\n  ",
+           MAX_GOSUB_STACK_DEPTH);
+    printf("gosub[gp++] = %u; ", i + op_size(op));
+    if (op == OP_GOSUB)
+      printf("goto L%u;", v);
+    else
+      printf("target = s[%d]; goto go_line;", --sp);
+    break;
+  case OP_GOTOX:
+    printf("target = s[%d]; goto go_line;", --sp);
+    break;
+  case OP_RETURN:
+    printf("if (gp > 0) { target = gosub[--gp]; goto resume; }");
+    break;
+  case OP_FOR:
+    sp -= 2;
+    printf("if (fp < %d) {\n"
+           "    fs[fp].var = %u; fs[fp].to = s[%d]; fs[fp].step = s[%d];\n"
+           "    fs[fp++].resume = %u;\n"
+           "  }", MAX_FOR_STACK_DEPTH, v, sp, sp + 1, i + 3);
+    break;
+  case OP_NEXT:
+    printf("if (fp == 0 || fs[fp - 1].var != %u)\n"
+           "    ubasic_error(\"Mismatched NEXT\");\n  ", v);
+    if (direct(v))
+      printf("x = *v%u += fs[fp - 1].step;\n  ", v);
+    else
+      printf("x = get(%u) + fs[fp - 1].step; set(%u, x);\n  ", v, v);
+    printf("if ((fs[fp - 1].step >= 0 && x <= fs[fp - 1].to) ||\n"
+           "      (fs[fp - 1].step < 0 && x >= fs[fp - 1].to)) {\n"
+           "    target = fs[fp - 1].resume; goto resume;\n"
+           "  }\n"
+           "  fp--;");
+    break;
+  case OP_STOP:
+    printf("ended = 1;");
+    break;
+  case OP_SYNTAX:
+    printf("ubasic_error(\"Syntax\");");
+    break;
+  default:
+    fprintf(stderr, "ubc: unknown op %u at %u\n", op, i);
+    exit(1);
+  }
+  if (bin) {
+    sp--;
+    printf("s[%d] = s[%d] %s s[%d];", sp - 1, sp - 1, bin, sp);
+  }
+  *spp = sp;
+}
+/*---------------------------------------------------------------------------*/
+static void write_run(void)
+{
+  unsigned int i;
+  int sp = 0;
+
+  printf("static void run(void)\n"
+         "{\n"
+         "  value_t s[%d];\n"
+         "  value_t x;\n"
+         "  int ended = 0;\n"
+         "  int target;\n"
+         "  int gosub[%d], gp = 0;\n"
+         "  struct { int var, resume; value_t to, step; } fs[%d];\n"
+         "  int fp = 0;\n\n",
+         MAX_EXPR_STACK + MAX_CODE_SUBSCRIPT, MAX_GOSUB_STACK_DEPTH,
+         MAX_FOR_STACK_DEPTH);
+
+  for (i = 0; i < code_len; i += op_size(code[i])) {
+    if (target[i])
+      printf("L%u:\n", i);
+    printf("  ");
+    write_op(i, &sp);
+    printf("\n");
+  }
+
+  if (returns) {
+    printf("resume:\n  switch(target) {\n");
+    for (i = 0; i < code_len; i += op_size(code[i]))
+      if (target[i] & 2)
+        printf("  case %u: goto L%u;\n", i, i);
+    printf("  }\n  return;\n");
+  }
+  if (lines) {
+    printf("go_line:\n  switch(target) {\n");
+    for (i = 0; i < code_len; i += op_size(code[i]))
+      if (target[i] & 4)
+        printf("  case %u: goto L%u;\n", OPERAND(code + i), i);
+    printf("  }\n  ubasic_error(\"Undefined line\");\n");
+  }
+  printf("  (void)x;\n"
+         "}\n\n");
+}
+/*---------------------------------------------------------------------------*/
+static void write_main(void)
+{
+  unsigned int var;
+
+  printf("static value_t peek(value_t arg)\n"
+         "{\n"
+         "  return arg;\n"
+         "}\n\n"
+         "static void poke(value_t arg, value_t value)\n"
+         "{\n"
+         "}\n\n"
+         "void clear_display(void)\n"
+         "{\n"
+         "  write(1, \"\\012\", 1);\n"
+         "}\n\n"
+         "int move_cursor(int x, int y)\n"
+         "{\n"
+         "  return 0;\n"
+         "}\n\n"
+         "void begin_input(void)\n"
+         "{\n"
+         "}\n\n"
+         "void end_input(void)\n"
+         "{\n"
+         "}\n\n"
+         "int main(int argc, char *argv[])\n"
+         "{\n"
+         "  struct typevalue t;\n\n"
+         "  if (setjmp(exception))\n"
+         "    return 1;\n"
+         "  ubasic_init_peek_poke(program, peek, poke);\n"
+         "  line_num = ubasic_line();\n");
+  /* Scalars never move so they can be looked up once */
+  for (var = 0; var < 65536; var++)
+    if (used[var])
+      printf("  v%u = ubasic_find_variable(%u, &t, 0, NULL);\n", var, var);
+  printf("  (void)t;\n"
+         "  run();\n"
+         "  return 0;\n"
+         "}\n");
+}
+/*---------------------------------------------------------------------------*/
+/* Nothing is run here */
+void clear_display(void)
+{
+}
+
+int move_cursor(int x, int y)
+{
+  return 0;
+}
+
+void begin_input(void)
+{
+}
+
+void end_input(void)
+{
+}
+/*---------------------------------------------------------------------------*/
+static char *load(const char *path)
+{
+  int fd;
+  struct stat s;
+  char *buf;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1 || fstat(fd, &s) == -1) {
+    perror(path);
+    exit(1);
+  }
+  buf = malloc(s.st_size + 1);
+  if (buf == NULL) {
+    fprintf(stderr, "ubc: out of memory\n");
+    exit(1);
+  }
+  if (read(fd, buf, s.st_size) != s.st_size) {
+    perror(path);
+    exit(1);
+  }
+  close(fd);
+  buf[s.st_size] = 0;
+  return buf;
+}
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+  char *buf;
+
+  if (argc != 2) {
+    fprintf(stderr, "%s: program\n", argv[0]);
+    exit(1);
+  }
+  buf = load(argv[1]);
+
+  if (setjmp(exception))
+    exit(1);
+  ubasic_init(buf);
+  code = ubasic_code(&code_len);
+  if (code == NULL) {
+    fprintf(stderr, "%s: program too large\n", argv[1]);
+    exit(1);
+  }
+  find_arrays();
+  find_targets();
+  find_variables();
+
+  printf("/* Generated by ubc from %s */\n\n", argv[1]);
+  write_header();
+  write_source(buf);
+  write_run();
+  write_main();
+  return 0;
+}
@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2006, Adam Dunkels
+ * All rights reserved.
+ *
+ * Copyright (c) 2015, Alan Cox
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ *	Run many BASIC programs at once, one per core. Each job is a program,
+ *	or a program and a file it reads its INPUT from, and gets its own
+ *	interpreter instance and output buffer. Jobs are dealt round the
+ *	workers' queues up front; a worker that runs dry steals from the far
+ *	end of another's queue. Once all are done the output is written in the
+ *	order the jobs were given, so it is the same however they ran.
+ *
+ *	ubp [-j threads] program.bas|directory ...
+ *	ubp [-j threads] -m manifest		lines of "program [input]"
+ *	ubp [-j threads] -i program.bas input ...
+ */
+
+#define UBASIC_THREADS
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <setjmp.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "ubasic.h"
+
+extern UBASIC_TLS jmp_buf exception;
+
+struct job {
+  const char *name;
+  const char *input_name;	/* NULL if it has no input */
+  char *program;
+  char *input;
+  size_t input_len;
+  size_t input_pos;
+  char *out;
+  size_t out_len;
+  size_t out_size;
+  int failed;
+};
+
+/* Each worker takes from the tail of its own queue and steals from the
+   head of the others */
+struct queue {
+  pthread_mutex_t lock;
+  unsigned int *job;
+  unsigned int head;
+  unsigned int tail;
+};
+
+static struct job *jobs;
+static unsigned int njobs;
+static unsigned int jobs_size;
+static struct queue *queues;
+static unsigned int nthreads;
+
+static UBASIC_TLS struct job *current_job;
+
+/*---------------------------------------------------------------------------*/
+static void fail(const char *p)
+{
+  perror(p);
+  exit(1);
+}
+
+static void *grow(void *p, size_t size)
+{
+  p = realloc(p, size);
+  if (p == NULL) {
+    write(2, "Out of memory.\n", 15);
+    exit(1);
+  }
+  return p;
+}
+
+static char *load(const char *name, size_t *len)
+{
+  int fd;
+  struct stat s;
+  char *buf;
+  ssize_t l;
+
+  fd = open(name, O_RDONLY);
+  if (fd == -1 || fstat(fd, &s) == -1)
+    fail(name);
+  buf = grow(NULL, s.st_size + 1);
+  l = read(fd, buf, s.st_size);
+  if (l != s.st_size)
+    fail(name);
+  close(fd);
+  buf[l] = 0;
+  if (len)
+    *len = l;
+  return buf;
+}
+
+static void add_job(const char *name, const char *input_name)
+{
+  struct job *j;
+
+  if (njobs == jobs_size) {
+    jobs_size = jobs_size ? jobs_size * 2 : 16;
+    jobs = grow(jobs, jobs_size * sizeof(struct job));
+  }
+  j = jobs + njobs++;
+  memset(j, 0, sizeof(struct job));
+  j->name = name;
+  j->input_name = input_name;
+}
+
+static int name_order(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Every .bas file in a directory, sorted so the order is repeatable */
+static void add_dir(const char *path, DIR *d)
+{
+  struct dirent *e;
+  char **names = NULL;
+  unsigned int n = 0, i;
+  size_t l;
+
+  while ((e = readdir(d)) != NULL) {
+    l = strlen(e->d_name);
+    if (l < 5 || strcmp(e->d_name + l - 4, ".bas"))
+      continue;
+    names = grow(names, (n + 1) * sizeof(char *));
+    names[n] = grow(NULL, strlen(path) + l + 2);
+    sprintf(names[n++], "%s/%s", path, e->d_name);
+  }
+  closedir(d);
+  qsort(names, n, sizeof(char *), name_order);
+  for (i = 0; i < n; i++)
+    add_job(names[i], NULL);
+  free(names);
+}
+
+static void add_manifest(const char *name)
+{
+  char *p = load(name, NULL);
+  char *prog, *input;
+
+  while (*p) {
+    prog = p + strspn(p, " \t");
+    p = prog + strcspn(prog, "\n");
+    if (*p)
+      *p++ = 0;
+    input = prog + strcspn(prog, " \t");
+    if (*input) {
+      *input++ = 0;
+      input += strspn(input, " \t");
+      input[strcspn(input, " \t\r")] = 0;
+    }
+    prog[strcspn(prog, "\r")] = 0;
+    if (*prog && *prog != '#')
+      add_job(prog, *input ? input : NULL);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* What the interpreter calls back for the job this thread is running */
+
+static value_t peek(value_t arg)
+{
+  return arg;
+}
+
+static void poke(value_t arg, value_t value)
+{
+}
+
+static void output(char c, void *ctx)
+{
+  struct job *j = ctx;
+
+  if (j->out_len == j->out_size) {
+    j->out_size = j->out_size ? j->out_size * 2 : 256;
+    j->out = grow(j->out, j->out_size);
+  }
+  j->out[j->out_len++] = c;
+}
+
+/* INPUT reads a line at a time from the job's input, EOF if it has none */
+int _read(int fd, char *buf, int len)
+{
+  struct job *j = current_job;
+  size_t n = 0;
+
+  if (j == NULL || j->input == NULL)
+    return 0;
+  while (n < len && j->input_pos < j->input_len) {
+    buf[n] = j->input[j->input_pos++];
+    if (buf[n++] == '\n')
+      break;
+  }
+  return n;
+}
+
+void clear_display(void)
+{
+  output('\n', current_job);
+}
+
+int move_cursor(int x, int y)
+{
+  return 0;
+}
+
+void begin_input(void)
+{
+}
+
+void end_input(void)
+{
+}
+
+/*---------------------------------------------------------------------------*/
+static void run_job(struct job *j)
+{
+  struct ubasic *u = ubasic_new();
+
+  if (u == NULL) {
+    j->failed = 1;
+    return;
+  }
+  current_job = j;
+  ubasic_use(u);
+  ubasic_output(output, j);
+  if (setjmp(exception) == 0) {
+    ubasic_init_peek_poke(j->program, peek, poke);
+    do {
+      ubasic_run();
+    } while(!ubasic_finished());
+  } else
+    j->failed = 1;
+  ubasic_free(u);
+  current_job = NULL;
+}
+
+static int take(struct queue *q, int steal)
+{
+  int n = -1;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->head != q->tail)
+    n = steal ? q->job[q->head++] : q->job[--q->tail];
+  pthread_mutex_unlock(&q->lock);
+  return n;
+}
+
+static void *worker(void *arg)
+{
+  unsigned int self = (struct queue *)arg - queues;
+  unsigned int i;
+  int n;
+
+  for (;;) {
+    n = take(queues + self, 0);
+    /* Jobs never make more jobs, so once every queue is empty we are done */
+    for (i = 1; n == -1 && i < nthreads; i++)
+      n = take(queues + (self + i) % nthreads, 1);
+    if (n == -1)
+      return NULL;
+    run_job(jobs + n);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+static void usage(const char *name)
+{
+  static const char msg[] = ": [-j threads] program|directory ...\n"
+                            "       [-j threads] -m manifest\n"
+                            "       [-j threads] -i program input ...\n";
+  write(2, name, strlen(name));
+  write(2, msg, sizeof(msg) - 1);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *name = argv[0];
+  const char *each = NULL;
+  pthread_t *threads;
+  unsigned int i;
+  long n;
+  int failed = 0;
+  DIR *d;
+
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  argv++;
+  for (; *argv && **argv == '-'; argv++) {
+    if (strcmp(*argv, "-j") == 0 && argv[1])
+      n = atoi(*++argv);
+    else if (strcmp(*argv, "-m") == 0 && argv[1])
+      add_manifest(*++argv);
+    else if (strcmp(*argv, "-i") == 0 && argv[1])
+      each = *++argv;
+    else
+      usage(name);
+  }
+  for (; *argv; argv++) {
+    if (each)
+      add_job(each, *argv);
+    else if ((d = opendir(*argv)) != NULL)
+      add_dir(*argv, d);
+    else
+      add_job(*argv, NULL);
+  }
+  if (njobs == 0)
+    usage(name);
+
+  for (i = 0; i < njobs; i++) {
+    /* Jobs sharing a program share its text, the interpreter never writes it */
+    if (i && jobs[i].name == jobs[i - 1].name)
+      jobs[i].program = jobs[i - 1].program;
+    else
+      jobs[i].program = load(jobs[i].name, NULL);
+    if (jobs[i].input_name)
+      jobs[i].input = load(jobs[i].input_name, &jobs[i].input_len);
+  }
+
+  nthreads = n < 1 ? 1 : n > njobs ? njobs : n;
+  queues = grow(NULL, nthreads * sizeof(struct queue));
+  threads = grow(NULL, nthreads * sizeof(pthread_t));
+  for (i = 0; i < nthreads; i++) {
+    pthread_mutex_init(&queues[i].lock, NULL);
+    queues[i].job = grow(NULL, (njobs / nthreads + 1) * sizeof(unsigned int));
+    queues[i].head = queues[i].tail = 0;
+  }
+  /* Dealt in reverse so each worker starts on its earliest job */
+  for (i = njobs; i-- > 0; ) {
+    struct queue *q = queues + i % nthreads;
+    q->job[q->tail++] = i;
+  }
+  for (i = 0; i < nthreads; i++)
+    if (pthread_create(threads + i, NULL, worker, queues + i))
+      fail("pthread_create");
+  for (i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+
+  for (i = 0; i < njobs; i++) {
+    struct job *j = jobs + i;
+    if (njobs > 1) {
+      printf("==> %s%s%s <==\n", j->name, j->input_name ? " < " : "",
+             j->input_name ? j->input_name : "");
+    }
+    fwrite(j->out, 1, j->out_len, stdout);
+    if (njobs > 1 && j->out_len && j->out[j->out_len - 1] != '\n')
+      putchar('\n');
+    if (j->failed) {
+      fprintf(stderr, "%s: failed\n", j->input_name ? j->input_name : j->name);
+      failed = 1;
+    }
+  }
+  return failed;
+}